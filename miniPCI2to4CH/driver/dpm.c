@@ -21,6 +21,41 @@
 #endif
 
 
+#ifdef __KERNEL__
+/* The host keeps copies of the queue variables which only it changes: the
+ * size never changes once the firmware has set up the queue, and of the
+ * pointers the host owns the read pointer of an Rx queue and the write
+ * pointer of a Tx queue. Only the pointer moved by the firmware is read from
+ * the DPM. The copies have to be loaded again with buf_init_host() whenever
+ * the firmware has (re)initialised the queues, e.g. after a board reset */
+void buf_init_host(struct buffer *buf, int owner)
+{
+    buf->owner=owner;
+    buf->size=ioread16(&buf->vars->size);
+    buf->wptr=ioread16(&buf->vars->wptr);
+    buf->rptr=ioread16(&buf->vars->rptr);
+}
+
+static inline void __buf_host_vars(struct buffer *buf, int *wptr, int *rptr, int *size)
+{
+    switch(buf->owner){
+    case BUF_HOST_RPTR:
+	*wptr=ioread16(&buf->vars->wptr);
+	*rptr=buf->rptr;
+	break;
+    case BUF_HOST_WPTR:
+	*wptr=buf->wptr;
+	*rptr=ioread16(&buf->vars->rptr);
+	break;
+    default:
+	*wptr=ioread16(&buf->vars->wptr);
+	*rptr=ioread16(&buf->vars->rptr);
+	break;
+    }
+    *size=buf->size;
+}
+#endif
+
 inline int __buf_is_full(int wptr, int rptr, int size)
 {
 
@@ -48,9 +83,7 @@ int buf_is_full(struct buffer *buf)
 {
     int wptr,rptr,size;
 #ifdef __KERNEL__
-    wptr=ioread16(&buf->vars->wptr);
-    rptr=ioread16(&buf->vars->rptr);
-    size=ioread16(&buf->vars->size);
+    __buf_host_vars(buf,&wptr,&rptr,&size);
 #else
     wptr=buf->vars->wptr;
     rptr=buf->vars->rptr;
@@ -66,9 +99,7 @@ int buf_is_empty(struct buffer *buf)
 {
     int wptr,rptr,size;
 #ifdef __KERNEL__
-    wptr=ioread16(&buf->vars->wptr);
-    rptr=ioread16(&buf->vars->rptr);
-    size=ioread16(&buf->vars->size);
+    __buf_host_vars(buf,&wptr,&rptr,&size);
 #else
     wptr=buf->vars->wptr;
     rptr=buf->vars->rptr;
@@ -83,20 +114,65 @@ int buf_is_empty(struct buffer *buf)
 int buf_real_size(struct buffer *buf)
 {
 #ifdef __KERNEL__
-    return ioread16(&buf->vars->size)-1;
+    return buf->size-1;
 #else
     return buf->vars->size-1;
 #endif
 }
 
 
+inline int __buf_message_cnt(int wptr, int rptr, int size)
+{
+    if(__buf_is_full(wptr,rptr,size)){
+	return size-1;
+    } else if (wptr==rptr){ // if empty
+	return 0;
+    } else if (rptr < wptr){
+	return wptr - rptr;
+    } else {
+	return size - (rptr - wptr);
+    }
+}
+
 int buf_message_cnt(struct buffer *buf)
 {
     int wptr,rptr,size;
 #ifdef __KERNEL__
+    __buf_host_vars(buf,&wptr,&rptr,&size);
+#else
+    wptr=buf->vars->wptr;
+    rptr=buf->vars->rptr;
+    size=buf->vars->size;
+#endif
+
+    CHECK_POSITION
+
+    return __buf_message_cnt(wptr,rptr,size);
+}
+
+#ifdef __KERNEL__
+/* buf_message_cnt() with both pointers read from the DPM. For a queue whose
+ * host pointer is moved by the application (IOC_SET_BYPASS), which leaves
+ * the host copy behind */
+int buf_dpm_message_cnt(struct buffer *buf)
+{
+    int wptr,rptr,size;
+
     wptr=ioread16(&buf->vars->wptr);
     rptr=ioread16(&buf->vars->rptr);
-    size=ioread16(&buf->vars->size);
+    size=buf->size;
+
+    CHECK_POSITION
+
+    return __buf_message_cnt(wptr,rptr,size);
+}
+#endif
+
+int buf_free_cnt(struct buffer *buf)
+{
+    int wptr,rptr,size;
+#ifdef __KERNEL__
+    __buf_host_vars(buf,&wptr,&rptr,&size);
 #else
     wptr=buf->vars->wptr;
     rptr=buf->vars->rptr;
@@ -105,15 +181,7 @@ int buf_message_cnt(struct buffer *buf)
 
     CHECK_POSITION
 
-    if(__buf_is_full(wptr,rptr,size)){
-	return size-1;
-    } else if (wptr==rptr){ // if empty
-	return 0;
-    } else if (rptr < wptr){
-	return wptr - rptr;
-    } else {
-	return size - (rptr - wptr);
-    }
+    return (size-1) - __buf_message_cnt(wptr,rptr,size);
 }
 
 
@@ -122,9 +190,7 @@ int buf_increment_wptr(struct buffer *buf)
 {
     int wptr,rptr,size;
 #ifdef __KERNEL__
-    wptr=ioread16(&buf->vars->wptr);
-    rptr=ioread16(&buf->vars->rptr);
-    size=ioread16(&buf->vars->size);
+    __buf_host_vars(buf,&wptr,&rptr,&size);
 #else
     wptr=buf->vars->wptr;
     rptr=buf->vars->rptr;
@@ -160,6 +226,7 @@ int buf_increment_wptr(struct buffer *buf)
     }
 
 #ifdef __KERNEL__
+    buf->wptr=wptr;
     iowrite16((uint16_t)wptr,&buf->vars->wptr);
 #else
     DPM_WRITE(&buf->vars->wptr, wptr);
@@ -170,13 +237,88 @@ int buf_increment_wptr(struct buffer *buf)
     return 0;
 }
 
+/* Move the write pointer over n units, which have all been written into the
+ * buffer. The new position is written only once, so the reader sees all of
+ * the units at the same time */
+int buf_advance_wptr(struct buffer *buf, int n)
+{
+    int wptr,rptr,size;
+#ifdef __KERNEL__
+    __buf_host_vars(buf,&wptr,&rptr,&size);
+#else
+    wptr=buf->vars->wptr;
+    rptr=buf->vars->rptr;
+    size=buf->vars->size;
+#endif
+
+    CHECK_POSITION
+
+    /* There has to be room for all of the units */
+    if(n<=0 || n>(size-1)-__buf_message_cnt(wptr,rptr,size)){
+#ifdef __HICO_FW__
+        except(n,rptr,wptr);
+#else
+	printk(KERN_ERR "%s: No room for %d units wptr=%d rptr=%d\n",__FUNCTION__,n,wptr,rptr);
+	return -1;
+#endif
+    }
+
+    wptr=(wptr+n)%size;
+
+#ifdef __KERNEL__
+    buf->wptr=wptr;
+    iowrite16((uint16_t)wptr,&buf->vars->wptr);
+#else
+    DPM_WRITE(&buf->vars->wptr, wptr);
+#endif
+
+    CHECK_POSITION
+
+    return 0;
+}
+
+/* Move the read pointer over n units, which have all been read out of the
+ * buffer */
+int buf_advance_rptr(struct buffer *buf, int n)
+{
+    int wptr,rptr,size;
+#ifdef __KERNEL__
+    __buf_host_vars(buf,&wptr,&rptr,&size);
+#else
+    wptr=buf->vars->wptr;
+    rptr=buf->vars->rptr;
+    size=buf->vars->size;
+#endif
+
+    CHECK_POSITION
+
+    /* There has to be at least n units in the buffer */
+    if(n<=0 || n>__buf_message_cnt(wptr,rptr,size)){
+#ifdef __HICO_FW__
+        except(n,rptr,wptr);
+#else
+	printk(KERN_ERR "%s: Less than %d units in buf wptr=%d rptr=%d\n",__FUNCTION__,n,wptr,rptr);
+	return -1;
+#endif
+    }
+
+    rptr=(rptr+n)%size;
+
+#ifdef __KERNEL__
+    buf->rptr=rptr;
+    iowrite16((uint16_t)rptr,&buf->vars->rptr);
+#else
+    DPM_WRITE(&buf->vars->rptr, rptr);
+#endif
+
+    return 0;
+}
+
 int buf_increment_rptr(struct buffer *buf)
 {
     int wptr,rptr,size;
 #ifdef __KERNEL__
-    wptr=ioread16(&buf->vars->wptr);
-    rptr=ioread16(&buf->vars->rptr);
-    size=ioread16(&buf->vars->size);
+    __buf_host_vars(buf,&wptr,&rptr,&size);
 #else
     wptr=buf->vars->wptr;
     rptr=buf->vars->rptr;
@@ -213,6 +355,7 @@ int buf_increment_rptr(struct buffer *buf)
     }
 
 #ifdef __KERNEL__
+    buf->rptr=rptr;
     iowrite16((uint16_t)rptr,&buf->vars->rptr);
 #else
     DPM_WRITE(&buf->vars->rptr, rptr);
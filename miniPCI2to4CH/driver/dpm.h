@@ -54,6 +54,15 @@ struct buffer_vars{
 struct buffer{
     BUF_UNIT *base;
     struct buffer_vars *vars;
+#ifdef __KERNEL__
+    /* Host copies of the queue variables, see buf_init_host() */
+#define BUF_HOST_RPTR 1 /* Rx queue - the host moves the read pointer */
+#define BUF_HOST_WPTR 2 /* Tx queue - the host moves the write pointer */
+    int owner;
+    int size;
+    int wptr;
+    int rptr;
+#endif
 };
 
 
@@ -388,12 +397,19 @@ struct dpm_4ch {
 /* 1<<15 reserved */
 
 /* dpm.c */
+#ifdef __KERNEL__
+void buf_init_host(struct buffer *buf, int owner);
+int buf_dpm_message_cnt(struct buffer *buf);
+#endif
 int buf_real_size(struct buffer *buf);
 int buf_is_full(struct buffer *buf);
 int buf_is_empty(struct buffer *buf);
 int buf_message_cnt(struct buffer *buf);
+int buf_free_cnt(struct buffer *buf);
 int buf_increment_wptr(struct buffer *buf);
+int buf_advance_wptr(struct buffer *buf, int n);
 int buf_increment_rptr(struct buffer *buf);
+int buf_advance_rptr(struct buffer *buf, int n);
 
 #define buf_not_empty(B) !buf_is_empty(B)
 #define buf_not_full(B) !buf_is_full(B)
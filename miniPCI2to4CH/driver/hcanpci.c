@@ -18,6 +18,18 @@
 #include <linux/poll.h>
 #include <linux/interrupt.h>
 #include <linux/version.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/eventfd.h>
+#include <linux/completion.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
 #include <asm/uaccess.h>
 #include <asm/io.h>
 
@@ -40,9 +52,99 @@ MODULE_DESCRIPTION("Driver for emtrion HiCO.CAN-MiniPCI CAN-bus cards");
 static unsigned int fw_update = 0;
 module_param(fw_update, int, 0664);
 
+/* Read the version of the boot firmware (fw1) when a board is probed. This
+ * restarts the board twice and is done in the background, for all boards
+ * at the same time (0 = don't, the proc file shows it as unknown) */
+static unsigned int fw1_probe = 1;
+module_param(fw1_probe, int, S_IRUGO);
+
 static unsigned int irqtrace = 0;
 module_param(irqtrace, int, 0664);
 
+/* Map the DPM message area a second time as write-combining memory and
+ * write transmitted messages through it. The uncached mapping of the same
+ * range stays in place, and on x86 with PAT the kernel then gives the
+ * second mapping the uncached type too, so this makes no difference
+ * there. It helps only where the mapping types aren't tracked */
+static unsigned int tx_wc = 0;
+module_param(tx_wc, int, S_IRUGO);
+
+/* Number of messages in the host memory receive FIFO of every node (0
+ * disables the FIFO, the value is rounded up to a power of two of at least
+ * FIFO_MIN_SIZE) and its default overflow policy (RX_FIFO_DROP_*) */
+static unsigned int rx_fifo_size = 0;
+module_param(rx_fifo_size, int, S_IRUGO);
+static unsigned int rx_fifo_policy = RX_FIFO_DROP_NEWEST;
+module_param(rx_fifo_policy, int, S_IRUGO);
+
+/* Number of messages in the host memory transmit queue of every node (0
+ * disables the queue). The queue is emptied into the DPM Tx buffer from the
+ * Tx interrupt, so write() only has to wait when the queue is full */
+static unsigned int tx_queue_size = 0;
+module_param(tx_queue_size, int, S_IRUGO);
+
+/* Service the CAN nodes from an interrupt thread instead of the interrupt
+ * handler. The handler only masks the Rx/Tx interrupts of the board and the
+ * thread polls all of the nodes until less than irq_poll_budget (at least
+ * 1) messages were moved in one pass, or for IRQ_POLL_PASSES_MAX passes.
+ * Only then are the interrupts enabled again */
+static unsigned int irq_poll = 0;
+module_param(irq_poll, int, S_IRUGO);
+static unsigned int irq_poll_budget = 64;
+module_param(irq_poll_budget, int, S_IRUGO);
+
+/* Passes the interrupt thread makes at most before it gives the interrupts
+ * back, however busy the nodes are. If there is more to do, the next
+ * interrupt brings it back */
+#define IRQ_POLL_PASSES_MAX 64
+
+/* Don't use the interrupt line at all. The boards are serviced from a timer
+ * poll_rate times a second instead (0 = use interrupts). Meant for shared
+ * interrupt lines which are busy with other devices */
+static unsigned int poll_rate = 0;
+module_param(poll_rate, int, S_IRUGO);
+#define POLL_RATE_MAX 50000
+
+/* Default Rx interrupt coalescing of the nodes with a receive FIFO, see
+ * IOC_SET_RX_COALESCE */
+static unsigned int rx_coalesce_usecs = 0;
+module_param(rx_coalesce_usecs, int, S_IRUGO);
+static unsigned int rx_coalesce_frames = 0;
+module_param(rx_coalesce_frames, int, S_IRUGO);
+
+/* Read the error statistics of the nodes every err_stat_refresh ms in the
+ * background, so that IOC_GET_ERR_STAT_CACHED doesn't have to wait for the
+ * board (0 = only when asked for) */
+static unsigned int err_stat_refresh = 0;
+module_param(err_stat_refresh, int, S_IRUGO);
+
+/* Update period of the mmap()ed status pages (HCAN_MMAP_STATUS) */
+static unsigned int status_usecs = 1000;
+module_param(status_usecs, int, S_IRUGO);
+#define STATUS_USECS_MIN 100
+
+/* How old (in us) the RAM copy of the DPM status may be when a status ioctl
+ * or proc file is served from it (0 = always read the DPM) */
+static unsigned int status_max_age = 1000;
+module_param(status_max_age, int, 0664);
+
+/* Restart a board whose firmware has crashed and give its nodes their
+ * configuration back (0 = leave the board in the exception state). A board
+ * which crashes again within RECOVER_HOLDOFF_MS is left alone */
+static unsigned int auto_recover = 1;
+module_param(auto_recover, int, 0664);
+#define RECOVER_HOLDOFF_MS 10000
+
+/* Bus off recovery the nodes start with, see IOC_SET_BUSOFF_RECOVERY */
+static unsigned int busoff_recovery = BUSOFF_RECOVER_OFF;
+module_param(busoff_recovery, int, S_IRUGO);
+static unsigned int busoff_delay_ms = 10;
+module_param(busoff_delay_ms, int, S_IRUGO);
+static unsigned int busoff_max_delay_ms = 10000;
+module_param(busoff_max_delay_ms, int, S_IRUGO);
+#define BUSOFF_POLL_MS 10
+#define BUSOFF_DELAY_MAX_MS 60000
+
 #define FIRST_MINOR 0
 #define MINOR_COUNT 64
 #define DRV_NAME "hcanpci"
@@ -53,9 +155,105 @@ module_param(major, int, S_IRUGO);
 #define iosetbits16(mask,address) iowrite16(ioread16(address)|(mask),(address))
 #define ioclrbits16(mask,address) iowrite16(ioread16(address)&~(mask),(address))
 
+/* Rx and Tx interrupts of all CAN nodes */
+#define INT_NODES (INT_CAN1_RX|INT_CAN1_TX|INT_CAN2_RX|INT_CAN2_TX|\
+	INT_CAN3_RX|INT_CAN3_TX|INT_CAN4_RX|INT_CAN4_TX)
+
 
 struct hcan_board;
 
+/* The status areas of the nodes and of the board, which follow each other
+ * in the DPM */
+struct dpm_status{
+    struct can_status can_status[NUMBER_OF_CAN_NODES];
+    struct board_status board_status;
+}PACKED;
+
+/* Host memory message FIFO of a node. As receive FIFO, the interrupt handler
+ * moves received messages from the DPM into it right away, so that a reader
+ * which is late doesn't make the small DPM queue overrun. As transmit queue,
+ * it holds the messages which didn't fit into the DPM yet. head and tail are
+ * free running counters and size is a power of two. Everything is protected
+ * by lock. policy, max_level and dropped are used only for receiving.
+ *
+ * Both live in a struct hcan_ring (see hico_api.h), which an application can
+ * mmap(). It then consumes the receive ring or fills the transmit ring
+ * without system calls. The index moved by the driver is published to the
+ * shared header and the one moved by the application is taken from there */
+struct hcan_fifo{
+    struct can_msg *msgs;
+    unsigned int size;
+    unsigned int head;
+    unsigned int tail;
+    spinlock_t lock;
+
+    struct hcan_ring *shared;
+    atomic_t mapped;
+
+    int policy;
+    unsigned int max_level;
+    uint64_t dropped;
+};
+#define FIFO_LEVEL(fifo) ((fifo)->head-(fifo)->tail)
+
+/* Take over the tail of a shared ring, which the application may have moved.
+ * A tail outside of the messages in the ring is ignored. Called with the
+ * FIFO lock held */
+static inline void fifo_sync_tail(struct hcan_fifo *fifo)
+{
+    unsigned int tail;
+
+    if(!fifo->shared)
+	return;
+
+    tail=ACCESS_ONCE(fifo->shared->tail);
+    if(fifo->head-tail <= fifo->size && tail-fifo->tail <= fifo->size){
+	fifo->tail=tail;
+    }
+
+    /* Don't overwrite messages before the application is done with them */
+    smp_mb();
+}
+
+/* Counterpart of fifo_sync_tail() for a mapped ring which the application
+ * fills */
+static inline void fifo_sync_head(struct hcan_fifo *fifo)
+{
+    unsigned int head;
+
+    if(!fifo->shared || !atomic_read(&fifo->mapped))
+	return;
+
+    head=ACCESS_ONCE(fifo->shared->head);
+    if(head-fifo->tail <= fifo->size && head-fifo->head <= fifo->size){
+	fifo->head=head;
+    }
+
+    /* Read the messages only after the head */
+    smp_rmb();
+}
+
+/* Any message fetched from the DPM queue at once has to fit in the FIFO */
+#define FIFO_MIN_SIZE 1024
+
+/* Configuration of a node as set by the applications, which is given back
+ * to it after the board has been restarted by auto_recover. Values which
+ * were never set are -1. The filters are kept as the commands which set
+ * them; filters_lost tells that there were more than NODE_MAX_FILTERS */
+#define NODE_MAX_FILTERS 32
+struct node_config{
+    int sjw_inc;
+    int bitrate;
+    int mode;
+    int nfilters;
+    int filters_lost;
+    struct{
+	uint16_t cmd;
+	uint32_t arg1;
+	uint32_t arg2;
+    } filters[NODE_MAX_FILTERS];
+};
+
 
 struct hcan_node{
     struct cdev cdev;
@@ -78,17 +276,92 @@ struct hcan_node{
     /* Tx and Rx buffers in DPM */
     struct buffer dpm_txbuf;
     struct buffer dpm_rxbuf;
+
+    /* Messages taken out of dpm_rxbuf and the number of burst reads that
+     * fetched them, shown in the proc file so the DPM accesses per received
+     * message can be measured */
+    unsigned long rx_burst_msgs;
+    unsigned long rx_bursts;
+
+    /* Transmit buffer units as seen through the write-combining mapping
+     * (same as dpm_txbuf.base if tx_wc is not set) */
+    BUF_UNIT *tx_base;
+
+    /* Receive FIFO and transmit queue in host memory (msgs is NULL if
+     * rx_fifo_size or tx_queue_size is 0) */
+    struct hcan_fifo rx_fifo;
+    struct hcan_fifo tx_queue;
+
+    /* Host memory where the messages of one write() are put together
+     * before they are copied into the DPM. Holds the whole Tx buffer */
+    struct can_msg *tx_stage;
     wait_queue_head_t ev_tx_ready;
     wait_queue_head_t ev_rx_ready;
 
+    /* Serialise readers of the receive buffer and writers of the transmit
+     * buffer */
+    struct mutex rx_lock;
+    struct mutex tx_lock;
+
     /* Pointers to CAN node status structures in DPM */
     struct can_status *can_status;
+
+    /* Rx interrupt coalescing. While coal_active is set, the Rx interrupt
+     * is masked and coal_timer picks up the messages. coal_active changes
+     * together with the Rx interrupt mask, under the int_lock of the
+     * board. coal holds the settings and counters reported with
+     * IOC_GET_RX_COALESCE */
+    struct hrtimer coal_timer;
+    struct rx_coalesce coal;
+    int coal_active;
+    u64 coal_start;
+
+    /* File which has detached the data path of the node with
+     * IOC_SET_BYPASS. The application then uses the DPM queues directly and
+     * the driver leaves them alone. bypass_lock is held while bypass is set
+     * or cleared and while the host FIFO or queue is mapped, so that the
+     * two don't both get the node */
+    struct file *bypass;
+    struct mutex bypass_lock;
+
+    /* Copy of the error statistics table of the firmware, read at
+     * err_stamp (0 = no copy). err_lock protects it and makes concurrent
+     * readers share one pass over the board */
+    struct mutex err_lock;
+    struct err_stat err_stat;
+    u64 err_stamp;
+    uint64_t err_refreshes;
+
+    /* Page which the application can mmap() to watch the status of the
+     * node. last_counts are the firmware message counters at the last
+     * update; counts_valid is cleared when the firmware has restarted */
+    struct hcan_status_page *status_page;
+    uint16_t last_counts[3];
+    int counts_valid;
+
+    /* Recorded by node_cmd(), protected by cfg_lock. node_cmd() holds it
+     * while the command is sent as well */
+    struct mutex cfg_lock;
+    struct node_config cfg;
+
+    /* Bus off recovery. busoff holds the settings and counters reported
+     * with IOC_GET_BUSOFF_RECOVERY. busoff_stamp is when the node was
+     * found bus off (0 = it isn't), busoff_due when it is restarted next,
+     * busoff_delay the current backoff delay in ms and busoff_back when
+     * the node last came back. Only board_busoff_work() changes them while
+     * it is scheduled */
+    struct busoff_recovery busoff;
+    u64 busoff_stamp;
+    u64 busoff_due;
+    unsigned int busoff_delay;
+    u64 busoff_back;
 };
 
 struct hcan_board{
     struct pci_dev *pdev;
     uint8_t *dpm_base;
     unsigned int dpm_size;
+    uint8_t *dpm_wc_base;
     uint16_t *dpm_sem_base;
     uint8_t *cfg_base;
     struct dpm *dpm;
@@ -96,11 +369,23 @@ struct hcan_board{
     int number;
     char proc_name[50];
     
-    /* these are updated in get_fw1_version */
+    /* these are updated in get_fw1_version and on a firmware update
+     * (fw1_version is -1 if not known) */
     int fw1_version;
     char fw1_date[4];
 
+    /* Reads the fw1 version after probe. fw_ready is completed when it is
+     * done and the board is running its firmware again; until then open()
+     * of the nodes waits */
+    struct work_struct fw1_work;
+    struct completion fw_ready;
+
     uint8_t pci_eeprom_rev;
+
+    /* Last seen value of board_status.fw_running. Updated by the interrupt
+     * handler and when the driver restarts the firmware, so that read() and
+     * write() don't have to check it over PCI */
+    volatile uint16_t fw_state;
     
     /* Directory where the proc files are */
     struct proc_dir_entry *proc_dir;
@@ -117,134 +402,1492 @@ struct hcan_board{
     /* Semaphore used when sending commands to the board */
     struct semaphore sem;
 
+    /* Held for writing while the firmware is restarted, together with
+     * whatever has to be done before the nodes can be used again, and for
+     * reading by node_cmd(). Commands wait for a restart to be over instead
+     * of timing out in the middle of it */
+    struct rw_semaphore restart_sem;
+
+    /* Copy of the DPM control area taken by the interrupt handler. Only the
+     * queue variables and the end of the area from
+     * board_status.cmd_ack_cnt on are copied, see dpm_snapshot() */
+    struct dpm snap;
+    uint16_t last_int_count;
+
+    /* Copy of the DPM int_enable register, which only the host writes. It
+     * is changed under int_lock and written to the DPM without reading it
+     * back, see board_int_update() */
+    spinlock_t int_lock;
+    uint16_t int_enable;
+
+    /* Node interrupts which the handler has masked for the interrupt
+     * thread (irq_poll). The thread enables them again when the nodes are
+     * idle. Protected by int_lock */
+    uint16_t poll_mask;
+    unsigned long poll_passes;
+
+    /* Timer which services the board instead of interrupts (poll_rate) */
+    struct hrtimer poll_timer;
+    ktime_t poll_period;
+
+    /* RAM copy of the DPM status areas, read at shadow_stamp (0 = none).
+     * shadow_gen changes whenever the status may have changed, so that a
+     * copy taken before that isn't stored. Protected by shadow_lock */
+    seqlock_t shadow_lock;
+    struct dpm_status shadow;
+    u64 shadow_stamp;
+    unsigned int shadow_gen;
+
+    /* Interrupt handler statistics shown in the proc file */
+    unsigned long irq_handled;
+    unsigned long irq_rejected;
+    u64 irq_ns_total;
+    u64 irq_ns_max;
+
+    /* Background refresh of the error statistics (err_stat_refresh) */
+    struct delayed_work err_work;
+
+    /* Commands submitted with IOC_CMD_SUBMIT, one list per priority.
+     * acmd_work carries them out one after the other. acmd_running is the
+     * one it is busy with. Protected by acmd_lock */
+    spinlock_t acmd_lock;
+    struct list_head acmd_queue[HCAN_PRIO_COUNT];
+    struct hcan_acmd *acmd_running;
+    wait_queue_head_t ev_acmd;
+    struct work_struct acmd_work;
+
+    /* Timer which updates the status pages of the nodes while any of them
+     * is mapped. status_maps counts the mappings, under status_lock */
+    struct hrtimer status_timer;
+    ktime_t status_period;
+    struct mutex status_lock;
+    int status_maps;
+
+    /* Every open file and every mmap() of a node holds a reference, so
+     * that the board is only freed after the last of them is gone, see
+     * board_put(). removed is set by hcan_pci_remove(), after which the
+     * files which are still open get ENODEV */
+    struct kref ref;
+    int removed;
+
+    /* Recovery from firmware exceptions (auto_recover). recoveries counts
+     * the restarts, recover_stamp is the time of the last one and
+     * excpt_text is what the firmware said about the exception.
+     * recover_lock is held while recovering and protects excpt_text */
+    struct work_struct recover_work;
+    struct mutex recover_lock;
+    unsigned long recoveries;
+    u64 recover_stamp;
+    char *excpt_text;
+
+    /* Looks for nodes which are bus off every BUSOFF_POLL_MS while any
+     * node has a recovery policy, and right away on INT_ERROR */
+    struct delayed_work busoff_work;
+
     int cmd_timeout;
     int latte_timeout;
 };
 
-struct proc_dir_entry *hcan_proc_dir=NULL;
+/* An open CAN device. The results of the commands submitted on it wait in
+ * results until IOC_CMD_RESULT takes them. count is the number of its
+ * commands which are queued, running or have uncollected results. lock
+ * protects results, count and eventfd */
+struct hcan_file{
+    struct hcan_node *node;
+    spinlock_t lock;
+    struct list_head results;
+    unsigned int count;
+    wait_queue_head_t ev_result;
+    struct eventfd_ctx *eventfd;
+
+    /* Set under the acmd_lock of the board when the file is closed */
+    int closing;
+};
+#define FILE_NODE(filp) (((struct hcan_file *)(filp)->private_data)->node)
+
+/* Command submitted with IOC_CMD_SUBMIT. step counts the error statistics
+ * entries read so far, the first of them at stamp */
+struct hcan_acmd{
+    struct list_head list;
+    struct hcan_file *owner;
+    struct hcan_cmd cmd;
+    struct hcan_cmd_result result;
+    int step;
+    u64 stamp;
+};
+
+struct proc_dir_entry *hcan_proc_dir=NULL;
+
+int board_count=0;
+
+static int node_fill_tx(struct hcan_node *node);
+
+/* Set and clear bits in int_enable. The caller holds int_lock. The DPM is
+ * only written if something changes */
+static void __board_int_update(struct hcan_board *board, uint16_t set, uint16_t clr)
+{
+    uint16_t val=(board->int_enable|set)&~clr;
+
+    if(val!=board->int_enable){
+	board->int_enable=val;
+	iowrite16(val,&board->dpm->int_enable);
+    }
+}
+
+static void board_int_update(struct hcan_board *board, uint16_t set, uint16_t clr)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&board->int_lock,flags);
+    __board_int_update(board,set,clr);
+    spin_unlock_irqrestore(&board->int_lock,flags);
+}
+#define board_int_enable(board,mask) board_int_update((board),(mask),0)
+#define board_int_disable(board,mask) board_int_update((board),0,(mask))
+
+/* Write all of int_enable, also when the copy says it's already there.
+ * Needed when the firmware has been restarted */
+static void board_int_write(struct hcan_board *board, uint16_t val)
+{
+    unsigned long flags;
+
+    spin_lock_irqsave(&board->int_lock,flags);
+    board->int_enable=val;
+    iowrite16(val,&board->dpm->int_enable);
+    spin_unlock_irqrestore(&board->int_lock,flags);
+}
+
+/* How long a restart of the board may take, and how often fw_running is
+ * looked at meanwhile */
+#define FW_START_TIMEOUT_MS 1000
+#define FW_POLL_US 200
+
+/* Wait until the board reports state in fw_running. Interrupts can't be
+ * used for this, the restart clears int_enable in the DPM. Returns 0 or
+ * -EIO if the firmware doesn't get there in FW_START_TIMEOUT_MS */
+static int board_wait_fw(struct hcan_board *board, uint16_t state)
+{
+    u64 end=ktime_get_ns()+FW_START_TIMEOUT_MS*NSEC_PER_MSEC;
+
+    while(ioread16(&board->dpm->board_status.fw_running)!=state){
+	if(ktime_get_ns()>end)
+	    return -EIO;
+	usleep_range(FW_POLL_US,2*FW_POLL_US);
+    }
+    return 0;
+}
+
+/* Make the next reader of the status go to the DPM */
+static void board_status_stale(struct hcan_board *board)
+{
+    unsigned long flags;
+
+    write_seqlock_irqsave(&board->shadow_lock,flags);
+    board->shadow_stamp=0;
+    board->shadow_gen++;
+    write_sequnlock_irqrestore(&board->shadow_lock,flags);
+}
+
+/* Get the status areas of the board. They come from the RAM copy if that
+ * is at most status_max_age us old, otherwise they are read from the DPM
+ * with one copy, which is kept for the next caller */
+static void board_get_status(struct hcan_board *board, struct dpm_status *st)
+{
+    u64 now=ktime_get_ns();
+    unsigned long flags;
+    unsigned int seq,gen;
+    int fresh;
+
+    do{
+	seq=read_seqbegin(&board->shadow_lock);
+	gen=board->shadow_gen;
+	fresh=board->shadow_stamp &&
+	    now-board->shadow_stamp<=(u64)status_max_age*NSEC_PER_USEC;
+	if(fresh)
+	    *st=board->shadow;
+    }while(read_seqretry(&board->shadow_lock,seq));
+
+    if(fresh)
+	return;
+
+    memcpy_fromio(st,&board->dpm->can_status[0],sizeof(*st));
+
+    write_seqlock_irqsave(&board->shadow_lock,flags);
+    if(board->shadow_gen==gen){
+	board->shadow=*st;
+	board->shadow_stamp=now;
+    }
+    write_sequnlock_irqrestore(&board->shadow_lock,flags);
+}
+
+/* Number of messages waiting in the transmit queue */
+static int node_tx_pending(struct hcan_node *node)
+{
+    unsigned long flags;
+    int n;
+
+    spin_lock_irqsave(&node->tx_queue.lock,flags);
+    fifo_sync_head(&node->tx_queue);
+    n=FIFO_LEVEL(&node->tx_queue);
+    spin_unlock_irqrestore(&node->tx_queue.lock,flags);
+
+    return n;
+}
+
+/* Wait until the interrupt handler or poll timer of the board isn't
+ * running anymore on another CPU */
+static void board_sync_service(struct hcan_board *board)
+{
+    if(poll_rate){
+	hrtimer_cancel(&board->poll_timer);
+	hrtimer_start(&board->poll_timer,board->poll_period,HRTIMER_MODE_REL);
+    } else {
+	synchronize_irq(board->pdev->irq);
+    }
+}
+
+/* Whether read() and write() may use the data path of the node. Returns 0,
+ * -EBUSY in bypass mode or -ENODEV once the board has been removed. Also
+ * used in the wait conditions, before anything is read from the DPM */
+static int node_data_path(struct hcan_node *node)
+{
+    if(node->board->removed)
+	return -ENODEV;
+    if(node->bypass)
+	return -EBUSY;
+    return 0;
+}
+
+/* Detach the data path of the node for filp or give it back to the driver.
+ * Readers and writers see bypass set and leave, after which the host FIFO
+ * and queue are emptied. When attaching again, the host copies of the queue
+ * pointers are reloaded since the application has moved them */
+static int node_set_bypass(struct hcan_node *node, struct file *filp, int on)
+{
+    struct hcan_board *board=node->board;
+    unsigned long flags;
+
+    if(on){
+	mutex_lock(&node->bypass_lock);
+	if(node->bypass){
+	    mutex_unlock(&node->bypass_lock);
+	    return node->bypass==filp ? 0 : -EBUSY;
+	}
+	if(atomic_read(&node->rx_fifo.mapped) || atomic_read(&node->tx_queue.mapped)){
+	    mutex_unlock(&node->bypass_lock);
+	    return -EBUSY;
+	}
+	node->bypass=filp;
+	mutex_unlock(&node->bypass_lock);
+
+	board_int_disable(board,node->rx_int|node->tx_int);
+	board_sync_service(board);
+	hrtimer_cancel(&node->coal_timer);
+	spin_lock_irqsave(&board->int_lock,flags);
+	node->coal_active=0;
+	spin_unlock_irqrestore(&board->int_lock,flags);
+	wake_up_interruptible(&node->ev_rx_ready);
+	wake_up_interruptible(&node->ev_tx_ready);
+
+	mutex_lock(&node->rx_lock);
+	mutex_lock(&node->tx_lock);
+	if(node->rx_fifo.msgs){
+	    spin_lock_irqsave(&node->rx_fifo.lock,flags);
+	    node->rx_fifo.tail=node->rx_fifo.head;
+	    node->rx_fifo.shared->tail=node->rx_fifo.tail;
+	    spin_unlock_irqrestore(&node->rx_fifo.lock,flags);
+	}
+	if(node->tx_queue.msgs){
+	    spin_lock_irqsave(&node->tx_queue.lock,flags);
+	    node->tx_queue.tail=node->tx_queue.head;
+	    node->tx_queue.shared->tail=node->tx_queue.tail;
+	    spin_unlock_irqrestore(&node->tx_queue.lock,flags);
+	}
+	mutex_unlock(&node->tx_lock);
+	mutex_unlock(&node->rx_lock);
+    } else {
+	mutex_lock(&node->bypass_lock);
+	if(node->bypass!=filp){
+	    mutex_unlock(&node->bypass_lock);
+	    return node->bypass ? -EBUSY : 0;
+	}
+
+	mutex_lock(&node->rx_lock);
+	mutex_lock(&node->tx_lock);
+	buf_init_host(&node->dpm_rxbuf,BUF_HOST_RPTR);
+	buf_init_host(&node->dpm_txbuf,BUF_HOST_WPTR);
+	node->bypass=NULL;
+	mutex_unlock(&node->tx_lock);
+	mutex_unlock(&node->rx_lock);
+	mutex_unlock(&node->bypass_lock);
+
+	if(node->rx_fifo.msgs){
+	    board_int_enable(board,node->rx_int);
+	}
+    }
+
+    return 0;
+}
+
+void reset_mode(struct hcan_board *board, int status)
+{
+    uint32_t val;
+    
+    /* CNTRL[30] is reset */
+    
+    val=readl(board->cfg_base+0x50);
+    
+    if(status){
+	val|=(1<<30);
+    } else {
+	val&=~(1<<30);
+    }
+
+    writel(val,board->cfg_base+0x50);
+
+}
+
+void set_fw_update_enable_pin(struct hcan_board *board, int state)
+{
+    uint32_t val;
+
+    /* GPIO control register is at 0x54 */
+    
+    val=readl(board->cfg_base+0x54);
+
+    if(state){
+	val|=(1<<2);
+    } else {
+	val&=~(1<<2);
+    }
+
+    writel(val,board->cfg_base+0x54);
+
+}
+
+/* Called after the firmware has been restarted. Update the cached firmware
+ * state and take over the message queue pointers which the firmware has set
+ * up again */
+void board_fw_restarted(struct hcan_board *board)
+{
+    int i;
+
+    board_status_stale(board);
+
+    /* The firmware may have started counting interrupts from anywhere.
+     * Make sure the next interrupt is looked at properly */
+    board->last_int_count=~ioread16(&board->dpm->int_count);
+
+    /* The DPM doesn't hold int_enable over a restart */
+    board_int_write(board,board->int_enable);
+
+    /* Nor the command ack count */
+    board->last_ack_count=ioread16(&board->dpm->board_status.cmd_ack_cnt);
+
+    board->fw_state=ioread16(&board->dpm->board_status.fw_running);
+
+    /* The firmware starts counting errors and messages from zero, with
+     * the nodes in reset */
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	board->node[i].err_stamp=0;
+	board->node[i].counts_valid=0;
+	board->node[i].busoff_stamp=0;
+    }
+
+    if(board->fw_state!=FW2_RUNNING)
+	return;
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(node->disabled || !node->dpm_rxbuf.base) continue;
+
+	buf_init_host(&node->dpm_rxbuf,BUF_HOST_RPTR);
+	buf_init_host(&node->dpm_txbuf,BUF_HOST_WPTR);
+    }
+}
+
+/* Restart the firmware of the board and wait until it runs again. Returns 0
+ * or -EIO */
+static int board_restart(struct hcan_board *board)
+{
+    int ret;
+
+    iowrite16(0,&board->dpm->board_status.fw_running);
+    board->fw_state=0;
+    reset_mode(board,1);
+    reset_mode(board,0);
+
+    /* The interrupt mask and the ack count are taken over by
+     * board_fw_restarted() */
+    ret=board_wait_fw(board,FW2_RUNNING);
+    board_fw_restarted(board);
+    return ret;
+}
+
+int error_map[]={
+    [E_OK] = 0,
+    [E_INVARG] = -EINVAL,
+    [E_INVCMD] = -EINVAL,
+    [E_IGNORED] = -EBUSY,
+};
+
+int board_cmd(struct hcan_board *board, uint16_t msg_code, 
+	uint32_t arg1, uint32_t arg2, uint32_t *retval)
+{
+    int ret=0;
+    int saved;
+
+
+    /* aquire board semaphore. Only one command allowed at a time */
+    if(down_interruptible(&board->sem)){
+	return -ERESTARTSYS;
+    }
+    
+    iowrite32(arg1,&board->dpm->args[0]);
+    iowrite32(arg2,&board->dpm->args[1]);
+
+    /* Wait for an answer */
+    board->cmd_ack=0;
+
+    saved=ioread16(&board->dpm->board_status.cmd_ack_cnt);
+
+    barrier();
+    /* Put the message in the mailbox. This will generate interrupt on the
+     * board */
+    iowrite16(msg_code,&board->dpm->mb_host2hico);
+    
+    if(wait_event_timeout(board->ev_cmd_ack, board->cmd_ack, board->cmd_timeout)==0){
+	printk(KERN_INFO "%s: No ack from board %s - timed out\n",
+		__FUNCTION__,pci_name(board->pdev));
+	ret= -EIO;
+	goto out;
+    }
+
+
+    /* Get the return value from the error cell */
+    ret=ioread16(&board->dpm->args[0]);
+    ret|=ioread16( ((uint16_t *)&board->dpm->args[0])+1 )<<16;
+    if(ret>sizeof(error_map)/4){
+	printk(KERN_WARNING "%s: invalid return value %d for command %d\n",
+		__FUNCTION__,ret,msg_code);
+	ret=-EIO;
+    } else {
+	ret=error_map[ret];
+    }
+
+    /* The DPM variables which the command changes may be updated a bit
+     * after the ACK. node_cmd() waits for the ones it knows about */
+    if(retval!=NULL){
+	*retval=ioread32(&board->dpm->args[1]);
+    }
+
+out:
+    /* free board semaphore */
+    up(&board->sem);
+    return ret;
+
+}
+
+
+/* How long the firmware may take to show the result of a command in the
+ * DPM after it has acknowledged it, and how often the DPM is looked at
+ * meanwhile. Each look is an uncached read, so not more often than that */
+#define CMD_SETTLE_US 2000
+#define CMD_SETTLE_POLL_US 50
+
+/* Wait until the DPM shows the state which a successful command leads to.
+ * The firmware acknowledges before it has updated the node status, so
+ * without this e.g. IOC_GET_MODE right after IOC_START could still see the
+ * old mode. The filter and SJW commands leave nothing in the DPM to wait
+ * for; the firmware has taken them over when it acknowledges, so they
+ * don't wait at all */
+static void node_cmd_settle(struct hcan_node *node, uint16_t cmd, uint32_t arg)
+{
+    void *var;
+    int left=0;
+    u64 end;
+
+    switch(cmd){
+    case CMD_SET_MODE:
+	var=&node->can_status->mode;
+	/* Baudscan moves on by itself once the bitrate is found, so it is
+	 * enough that the node has left reset */
+	if(arg==CM_BAUDSCAN){
+	    left=1;
+	    arg=CM_RESET;
+	}
+	break;
+    case CMD_SET_BITRATE:
+	var=&node->can_status->bitrate_i;
+	break;
+    default:
+	return;
+    }
+
+    end=ktime_get_ns()+CMD_SETTLE_US*NSEC_PER_USEC;
+    while((ioread16(var)==(uint16_t)arg)==left){
+	if(ktime_get_ns()>end){
+	    printk(KERN_INFO "%s: result of command %d not in DPM of can%d after %d us\n",
+		    __FUNCTION__,cmd,node->minor,CMD_SETTLE_US);
+	    return;
+	}
+	usleep_range(CMD_SETTLE_POLL_US,2*CMD_SETTLE_POLL_US);
+    }
+}
+
+static void node_cfg_init(struct node_config *cfg)
+{
+    memset(cfg,0,sizeof(*cfg));
+    cfg->sjw_inc=-1;
+    cfg->bitrate=-1;
+    cfg->mode=-1;
+}
+
+/* The nodes of a board are back in their default configuration */
+static void board_cfg_clear(struct hcan_board *board)
+{
+    int i;
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(node->disabled) continue;
+
+	mutex_lock(&node->cfg_lock);
+	node_cfg_init(&node->cfg);
+	mutex_unlock(&node->cfg_lock);
+    }
+}
+
+/* Remember a configuration command which the node has carried out. Called
+ * with cfg_lock held */
+static void node_cfg_record(struct hcan_node *node, uint16_t cmd,
+	uint32_t arg1, uint32_t arg2)
+{
+    struct node_config *cfg=&node->cfg;
+
+    switch(cmd){
+    case CMD_SET_SJW_INCREMENT:
+	cfg->sjw_inc=arg1;
+	break;
+    case CMD_SET_BITRATE:
+	cfg->bitrate=arg1;
+	break;
+    case CMD_SET_MODE:
+	cfg->mode=arg1;
+	break;
+    case CMD_CLR_FILTERS:
+	cfg->nfilters=0;
+	cfg->filters_lost=0;
+	break;
+    case CMD_SET_RANGE_FILTER:
+    case CMD_SET_AMASK_FILTER:
+	if(cfg->nfilters<NODE_MAX_FILTERS){
+	    cfg->filters[cfg->nfilters].cmd=cmd;
+	    cfg->filters[cfg->nfilters].arg1=arg1;
+	    cfg->filters[cfg->nfilters].arg2=arg2;
+	    cfg->nfilters++;
+	} else {
+	    cfg->filters_lost=1;
+	}
+	break;
+    }
+}
+
+/* Whether node_cfg_record() keeps the command */
+static int node_cfg_cmd(uint16_t cmd)
+{
+    switch(cmd){
+    case CMD_SET_SJW_INCREMENT:
+    case CMD_SET_BITRATE:
+    case CMD_SET_MODE:
+    case CMD_CLR_FILTERS:
+    case CMD_SET_RANGE_FILTER:
+    case CMD_SET_AMASK_FILTER:
+	return 1;
+    }
+    return 0;
+}
+
+/* Send a command to a node without recording it. Called with restart_sem
+ * held */
+static int node_cmd_send(struct hcan_node *node, uint16_t cmd, 
+	uint32_t arg1, uint32_t arg2,uint32_t *retval)
+{
+    int ret;
+
+    /* Check that the firmware is running */
+    if(node->board->fw_state!=FW2_RUNNING){
+	printk(KERN_WARNING "%s: Firmware fw2 not running on board %s (fw_running=%04x)\n",
+		__FUNCTION__,pci_name(node->board->pdev),
+		node->board->fw_state);
+	return -EIO;
+    }
+
+    /* put the CAN node number into the command */
+    ret=board_cmd(node->board, (cmd&0xff)|(node->number<<8), arg1, arg2, retval);
+    if(ret==0){
+	node_cmd_settle(node,cmd,arg1);
+    }
+    board_status_stale(node->board);
+
+    return ret;
+}
+
+/* node_cmd() for the restart paths, which hold restart_sem already.
+ *
+ * A configuration command and its record are one step under cfg_lock.
+ * Recording only afterwards would let a command of another caller reach
+ * the node in between, so that the record ends up in another order than
+ * the node got the commands. node_busoff_check() relies on it as well: it
+ * restarts a node under cfg_lock, and an IOC_STOP which has already been
+ * sent but not yet recorded would be undone. Since the board carries out
+ * one command at a time anyway (board->sem), this only makes the
+ * configuration commands of the same node wait for each other in the
+ * order in which they take cfg_lock. The other commands, e.g. the error
+ * statistics reads, don't take it */
+static int __node_cmd(struct hcan_node *node, uint16_t cmd, 
+	uint32_t arg1, uint32_t arg2,uint32_t *retval)
+{
+    int ret;
+
+    if(!node_cfg_cmd(cmd))
+	return node_cmd_send(node,cmd,arg1,arg2,retval);
+
+    mutex_lock(&node->cfg_lock);
+    ret=node_cmd_send(node,cmd,arg1,arg2,retval);
+    if(ret==0){
+	node_cfg_record(node,cmd,arg1,arg2);
+    }
+    mutex_unlock(&node->cfg_lock);
+
+    return ret;
+}
+
+int node_cmd(struct hcan_node *node, uint16_t cmd, 
+	uint32_t arg1, uint32_t arg2,uint32_t *retval)
+{
+    int ret;
+
+    down_read(&node->board->restart_sem);
+    ret=__node_cmd(node,cmd,arg1,arg2,retval);
+    up_read(&node->board->restart_sem);
+
+    return ret;
+}
+
+/* Read the error statistics table of a node into node->err_stat, unless the
+ * copy there is at most max_age ns old. The firmware gives out one entry
+ * per command, and the board semaphore is taken for each of them
+ * separately, so other commands get through in between. Called with
+ * err_lock held */
+static int node_update_err_stat(struct hcan_node *node, u64 max_age)
+{
+    struct err_stat tmp;
+    uint32_t val;
+    u64 start;
+    int i,ret;
+
+    start=ktime_get_ns();
+    if(node->err_stamp && start-node->err_stamp<=max_age)
+	return 0;
+
+    for(i=0;i<0x3f;i++){
+	ret=node_cmd(node,CMD_GET_ERR_STAT,i,0,&val);
+	if(ret){
+	    return ret;
+	}
+	tmp.values[i]=val;
+    }
+
+    /* The age of the table is that of its first entry */
+    node->err_stat=tmp;
+    node->err_stamp=start;
+    node->err_refreshes++;
+    return 0;
+}
+
+/* Check that a node has got into the mode which it has been put into */
+static int node_mode_check(struct hcan_node *node, int mode)
+{
+    int val;
+
+    val=ioread16(&node->can_status->mode);
+    /* A baudscan may already be over */
+    if(mode==CM_BAUDSCAN ? val==CM_RESET : val!=mode){
+	printk(KERN_ERR "%s: can%d in mode %d instead of %d\n",
+		__FUNCTION__,node->minor,val,mode);
+	return -EIO;
+    }
+    return 0;
+}
+
+/* Put a node into mode and check that it got there */
+static int node_set_mode(struct hcan_node *node, int mode)
+{
+    int ret;
+
+    ret=node_cmd(node,CMD_SET_MODE,mode,0,NULL);
+    if(ret==0){
+	ret=node_mode_check(node,mode);
+    }
+    return ret;
+}
+
+/* Take a node through reset and back into mode without recording it, the
+ * node keeps the configuration which the application has given it. Called
+ * with restart_sem and cfg_lock held */
+static int node_restart(struct hcan_node *node, int mode)
+{
+    int ret;
+
+    ret=node_cmd_send(node,CMD_SET_MODE,CM_RESET,0,NULL);
+    if(ret==0) ret=node_mode_check(node,CM_RESET);
+    if(ret==0) ret=node_cmd_send(node,CMD_SET_MODE,mode,0,NULL);
+    if(ret==0) ret=node_mode_check(node,mode);
+    return ret;
+}
+
+static int node_set_filter(struct hcan_node *node, struct can_filter *filter)
+{
+    int ret;
+
+    switch(filter->type){
+    case FTYPE_RANGE:
+	ret=node_cmd(node,CMD_SET_RANGE_FILTER,filter->lower,filter->upper,NULL);
+	break;
+    case FTYPE_AMASK:
+	ret=node_cmd(node,CMD_SET_AMASK_FILTER,filter->mask,filter->code,NULL);
+	break;
+    default:
+	ret=-EINVAL;
+	break;
+    }
+    iosetbits16(CF_FILTERS_ACTIVE, &node->can_status->flags2hico);
+    return ret;
+}
+
+static int node_clear_filters(struct hcan_node *node)
+{
+    int ret;
+
+    ret=node_cmd(node,CMD_CLR_FILTERS,0,0,NULL);
+    ioclrbits16(CF_FILTERS_ACTIVE, &node->can_status->flags2hico);
+    return ret;
+}
+
+static int node_clear_err_stat(struct hcan_node *node)
+{
+    int ret;
+
+    ret=node_cmd(node,CMD_CLR_ERR_STAT,0,0,NULL);
+    if(ret==0){
+	mutex_lock(&node->err_lock);
+	node->err_stamp=0;
+	mutex_unlock(&node->err_lock);
+    }
+    return ret;
+}
+
+static void board_err_work(struct work_struct *work)
+{
+    struct hcan_board *board=container_of(to_delayed_work(work),
+	    struct hcan_board,err_work);
+    int i;
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(node->disabled || board->fw_state!=FW2_RUNNING) continue;
+
+	/* Skip tables which a reader has just fetched */
+	mutex_lock(&node->err_lock);
+	node_update_err_stat(node,err_stat_refresh*NSEC_PER_MSEC/2);
+	mutex_unlock(&node->err_lock);
+    }
+
+    schedule_delayed_work(&board->err_work,msecs_to_jiffies(err_stat_refresh));
+}
+
+/* Give a node the configuration it had before the board was restarted. The
+ * SJW increment has to come before the bitrate and the mode last. The
+ * record is built up again by the commands as they succeed. Returns the
+ * first error. Called with restart_sem held for writing */
+static int node_cfg_replay(struct hcan_node *node)
+{
+    struct node_config cfg;
+    int i,err,ret=0;
+
+    mutex_lock(&node->cfg_lock);
+    cfg=node->cfg;
+    node_cfg_init(&node->cfg);
+    node->cfg.filters_lost=cfg.filters_lost;
+    mutex_unlock(&node->cfg_lock);
+
+    if(cfg.sjw_inc>=0){
+	err=__node_cmd(node,CMD_SET_SJW_INCREMENT,cfg.sjw_inc,0,NULL);
+	if(err && !ret) ret=err;
+    }
+    if(cfg.bitrate>=0){
+	err=__node_cmd(node,CMD_SET_BITRATE,cfg.bitrate,0,NULL);
+	if(err && !ret) ret=err;
+    }
+    for(i=0;i<cfg.nfilters;i++){
+	err=__node_cmd(node,cfg.filters[i].cmd,
+		cfg.filters[i].arg1,cfg.filters[i].arg2,NULL);
+	if(err && !ret) ret=err;
+    }
+    if(cfg.nfilters){
+	iosetbits16(CF_FILTERS_ACTIVE, &node->can_status->flags2hico);
+    }
+    if(cfg.filters_lost){
+	printk(KERN_WARNING "%s: can%d had more than %d filters, only the first ones are set again\n",
+		__FUNCTION__,node->minor,NODE_MAX_FILTERS);
+    }
+
+    /* The firmware starts with the nodes in reset */
+    if(cfg.mode>=0 && cfg.mode!=CM_RESET){
+	err=__node_cmd(node,CMD_SET_MODE,cfg.mode,0,NULL);
+	if(err && !ret) ret=err;
+    }
+
+    return ret;
+}
+
+/* Size of the exception text kept from the firmware */
+#define EXCPT_TEXT_LEN 2048
+
+/* Ask the firmware what the exception was about. It writes the text to the
+ * start of the DPM. Called with recover_lock held */
+static void board_save_exception(struct hcan_board *board)
+{
+    if(!board->excpt_text){
+	board->excpt_text=kmalloc(EXCPT_TEXT_LEN,GFP_KERNEL);
+	if(!board->excpt_text)
+	    return;
+    }
+
+    /* The text would have to be converted to big endian */
+#ifndef __BIG_ENDIAN
+    if(board_cmd(board,CMD_PRINT_EXCEPTION,0,0,NULL)==0){
+	memcpy_fromio(board->excpt_text,board->dpm_base,EXCPT_TEXT_LEN-1);
+	board->excpt_text[EXCPT_TEXT_LEN-1]=0;
+	return;
+    }
+#endif
+    strlcpy(board->excpt_text,"no exception text from the firmware\n",
+	    EXCPT_TEXT_LEN);
+}
+
+/* The firmware of the board has crashed. Keep its exception text, restart
+ * it and set the nodes up again the way the applications had them. The
+ * applications see a gap in the traffic and the recoveries count go up in
+ * their node status */
+static void board_recover_work(struct work_struct *work)
+{
+    struct hcan_board *board=container_of(work,struct hcan_board,recover_work);
+    u64 now=ktime_get_ns();
+    int i,ret;
+
+    printk(KERN_ERR "%s: firmware exception on board %s (error %04x)\n",
+	    __FUNCTION__,pci_name(board->pdev),
+	    ioread16(&board->dpm->board_status.error));
+
+    mutex_lock(&board->recover_lock);
+    down_write(&board->restart_sem);
+
+    board_save_exception(board);
+    if(board->excpt_text){
+	printk(KERN_ERR "%s",board->excpt_text);
+    }
+
+    if(board->recover_stamp &&
+	    now-board->recover_stamp<(u64)RECOVER_HOLDOFF_MS*NSEC_PER_MSEC){
+	printk(KERN_ERR "%s: board %s crashed again within %d ms, not restarting it\n",
+		__FUNCTION__,pci_name(board->pdev),RECOVER_HOLDOFF_MS);
+	goto out;
+    }
+    board->recover_stamp=now;
+
+    ret=board_restart(board);
+    if(ret){
+	printk(KERN_ERR "%s: could not restart the firmware of board %s\n",
+		__FUNCTION__,pci_name(board->pdev));
+	goto out;
+    }
+    board->recoveries++;
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(node->disabled || !node->dpm_rxbuf.base) continue;
+
+	if(node_cfg_replay(node)){
+	    printk(KERN_WARNING "%s: can%d did not get all of its configuration back\n",
+		    __FUNCTION__,node->minor);
+	}
+
+	/* Writers may wait for room in the queues the restart has emptied */
+	if(node->tx_queue.msgs && !node->bypass && node_fill_tx(node)){
+	    board_int_enable(board,node->tx_int);
+	}
+	wake_up_interruptible(&node->ev_tx_ready);
+    }
+
+    printk(KERN_INFO "%s: board %s running again after %llu us\n",
+	    __FUNCTION__,pci_name(board->pdev),
+	    (unsigned long long)div_u64(ktime_get_ns()-now,NSEC_PER_USEC));
+
+out:
+    up_write(&board->restart_sem);
+    mutex_unlock(&board->recover_lock);
+}
+
+static int busoff_settings_valid(struct busoff_recovery *br)
+{
+    switch(br->policy){
+    case BUSOFF_RECOVER_OFF:
+    case BUSOFF_RECOVER_IMMEDIATE:
+	return 1;
+    case BUSOFF_RECOVER_BACKOFF:
+	return br->delay_ms>0 && br->delay_ms<=br->max_delay_ms &&
+	    br->max_delay_ms<=BUSOFF_DELAY_MAX_MS;
+    }
+    return 0;
+}
+
+/* Enable INT_ERROR while any node of the board has a bus off recovery
+ * policy, and mask it again when none has one left. The policies are
+ * looked at under int_lock, so that the last caller sees all of them */
+static void board_busoff_int_update(struct hcan_board *board)
+{
+    unsigned long flags;
+    int i,active=0;
+
+    spin_lock_irqsave(&board->int_lock,flags);
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(!node->disabled && node->busoff.policy!=BUSOFF_RECOVER_OFF)
+	    active=1;
+    }
+    if(active){
+	__board_int_update(board,INT_ERROR,0);
+    } else {
+	__board_int_update(board,0,INT_ERROR);
+    }
+    spin_unlock_irqrestore(&board->int_lock,flags);
+}
+
+/* The node is on the bus again, count how long it took */
+static void node_busoff_back(struct hcan_node *node, u64 now)
+{
+    struct busoff_recovery *br=&node->busoff;
+    u64 t=div_u64(now-node->busoff_stamp,NSEC_PER_USEC);
+
+    br->recoveries++;
+    br->recovery_us_total+=t;
+    if(t>br->recovery_us_max)
+	br->recovery_us_max=t;
+    node->busoff_stamp=0;
+    node->busoff_back=now;
+}
+
+/* Check a node which has a bus off recovery policy and restart it when it
+ * is due. Only started nodes are looked after; one which the application
+ * has stopped is left alone */
+static void node_busoff_check(struct hcan_node *node, u64 now)
+{
+    struct hcan_board *board=node->board;
+    struct busoff_recovery *br=&node->busoff;
+    int mode=ACCESS_ONCE(node->cfg.mode);
+    int started=(mode==CM_ACTIVE || mode==CM_PASSIVE);
+    unsigned int delay;
+    int ret;
+
+    if(!(ioread8(&node->can_status->can_gsr)&CS_ERROR_BUS_OFF)){
+	if(node->busoff_stamp){
+	    if(started){
+		node_busoff_back(node,now);
+	    } else {
+		node->busoff_stamp=0;
+	    }
+	}
+	return;
+    }
+    if(!started)
+	return;
+
+    if(!node->busoff_stamp){
+	node->busoff_stamp=now;
+	br->bus_offs++;
+
+	/* Back off further if the node didn't stay on the bus for long */
+	delay=0;
+	if(br->policy==BUSOFF_RECOVER_BACKOFF){
+	    if(node->busoff_delay &&
+		    now-node->busoff_back<(u64)br->max_delay_ms*NSEC_PER_MSEC){
+		delay=min(node->busoff_delay*2,br->max_delay_ms);
+	    } else {
+		delay=br->delay_ms;
+	    }
+	}
+	node->busoff_delay=delay;
+	node->busoff_due=now+(u64)delay*NSEC_PER_MSEC;
+    }
+
+    if(now<node->busoff_due)
+	return;
+
+    /* Going through reset clears the error counters of the controller.
+     * The mode is taken again under cfg_lock, which keeps an IOC_STOP from
+     * coming in between. A failed restart leaves the record as it is, so
+     * it is tried again */
+    down_read(&board->restart_sem);
+    mutex_lock(&node->cfg_lock);
+    mode=node->cfg.mode;
+    if(mode!=CM_ACTIVE && mode!=CM_PASSIVE){
+	mutex_unlock(&node->cfg_lock);
+	up_read(&board->restart_sem);
+	node->busoff_stamp=0;
+	return;
+    }
+    br->restarts++;
+    ret=node_restart(node,mode);
+    mutex_unlock(&node->cfg_lock);
+    up_read(&board->restart_sem);
+
+    if(ret==0 && !(ioread8(&node->can_status->can_gsr)&CS_ERROR_BUS_OFF)){
+	node_busoff_back(node,ktime_get_ns());
+	return;
+    }
+
+    /* Still bus off, try again later */
+    if(br->policy==BUSOFF_RECOVER_BACKOFF){
+	node->busoff_delay=min(node->busoff_delay*2,br->max_delay_ms);
+    }
+    node->busoff_due=now+(u64)max_t(unsigned int,node->busoff_delay,BUSOFF_POLL_MS)*NSEC_PER_MSEC;
+}
+
+static void board_busoff_work(struct work_struct *work)
+{
+    struct hcan_board *board=container_of(to_delayed_work(work),
+	    struct hcan_board,busoff_work);
+    u64 now=ktime_get_ns();
+    int i,active=0;
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(node->disabled || node->busoff.policy==BUSOFF_RECOVER_OFF) continue;
+
+	active=1;
+	if(board->fw_state==FW2_RUNNING){
+	    node_busoff_check(node,now);
+	}
+    }
+
+    if(active){
+	schedule_delayed_work(&board->busoff_work,msecs_to_jiffies(BUSOFF_POLL_MS));
+    }
+}
+
+/* Carry out an asynchronous command, or the next part of it. Returns 1 if
+ * there is more to do */
+static int node_acmd_step(struct hcan_node *node, struct hcan_acmd *acmd)
+{
+    struct hcan_cmd_result *res=&acmd->result;
+    uint32_t val;
+    int ret;
+
+    switch(acmd->cmd.ioctl){
+    case IOC_START:
+	ret=node_set_mode(node,CM_ACTIVE);
+	break;
+    case IOC_START_PASSIVE:
+	ret=node_set_mode(node,CM_PASSIVE);
+	break;
+    case IOC_START_BAUDSCAN:
+	ret=node_set_mode(node,CM_RESET);
+	if(ret==0) ret=node_set_mode(node,CM_BAUDSCAN);
+	break;
+    case IOC_STOP:
+	ret=node_set_mode(node,CM_RESET);
+	break;
+    case IOC_SET_BITRATE:
+	ret=node_cmd(node,CMD_SET_BITRATE,acmd->cmd.arg.val,0,NULL);
+	break;
+    case IOC_SET_SJW_INCREMENT:
+	ret=node_cmd(node,CMD_SET_SJW_INCREMENT,acmd->cmd.arg.val,0,NULL);
+	break;
+    case IOC_SET_FILTER:
+	ret=node_set_filter(node,&acmd->cmd.arg.filter);
+	break;
+    case IOC_CLEAR_FILTERS:
+	ret=node_clear_filters(node);
+	break;
+    case IOC_RESET_TIMESTAMP:
+	ret=node_cmd(node,CMD_RESET_TIMESTAMP,0,0,NULL);
+	break;
+    case IOC_CLEAR_ERR_STAT:
+	ret=node_clear_err_stat(node);
+	break;
+    case IOC_GET_ERR_STAT:
+	if(acmd->step==0)
+	    acmd->stamp=ktime_get_ns();
+	ret=node_cmd(node,CMD_GET_ERR_STAT,acmd->step,0,&val);
+	if(ret==0){
+	    res->err_stat.values[acmd->step++]=val;
+	    if(acmd->step<0x3f)
+		return 1;
+
+	    /* Keep the table for IOC_GET_ERR_STAT_CACHED, as the synchronous
+	     * IOC_GET_ERR_STAT does. A newer copy is left alone */
+	    mutex_lock(&node->err_lock);
+	    if(node->err_stamp<acmd->stamp){
+		node->err_stat=res->err_stat;
+		node->err_stamp=acmd->stamp;
+		node->err_refreshes++;
+	    }
+	    mutex_unlock(&node->err_lock);
+	}
+	break;
+    default:
+	ret=-EINVAL;
+	break;
+    }
+
+    res->status=ret;
+    return 0;
+}
+
+static struct hcan_acmd *board_acmd_next(struct hcan_board *board)
+{
+    struct hcan_acmd *acmd=NULL;
+    int p;
+
+    spin_lock(&board->acmd_lock);
+    for(p=0;p<HCAN_PRIO_COUNT;p++){
+	if(!list_empty(&board->acmd_queue[p])){
+	    acmd=list_first_entry(&board->acmd_queue[p],struct hcan_acmd,list);
+	    list_del(&acmd->list);
+	    break;
+	}
+    }
+    board->acmd_running=acmd;
+    spin_unlock(&board->acmd_lock);
+
+    return acmd;
+}
+
+static void board_acmd_work(struct work_struct *work)
+{
+    struct hcan_board *board=container_of(work,struct hcan_board,acmd_work);
+    struct hcan_acmd *acmd;
+    struct hcan_file *hf;
+    int more;
+
+    while((acmd=board_acmd_next(board))!=NULL){
+	hf=acmd->owner;
+	more=node_acmd_step(hf->node,acmd);
+
+	spin_lock(&board->acmd_lock);
+	board->acmd_running=NULL;
+	if(hf->closing){
+	    kfree(acmd);
+	} else if(more){
+	    /* Go on from here next time, unless something more urgent has
+	     * come in meanwhile */
+	    list_add(&acmd->list,&board->acmd_queue[acmd->cmd.priority]);
+	} else {
+	    spin_lock(&hf->lock);
+	    list_add_tail(&acmd->list,&hf->results);
+	    if(hf->eventfd)
+		eventfd_signal(hf->eventfd,1);
+	    spin_unlock(&hf->lock);
+	    wake_up_interruptible(&hf->ev_result);
+	}
+	spin_unlock(&board->acmd_lock);
+	wake_up(&board->ev_acmd);
+    }
+}
+
+static int file_acmd_submit(struct hcan_file *hf, struct hcan_cmd *cmd)
+{
+    struct hcan_board *board=hf->node->board;
+    struct hcan_acmd *acmd;
+
+    switch(cmd->ioctl){
+    case IOC_START:
+    case IOC_START_PASSIVE:
+    case IOC_START_BAUDSCAN:
+    case IOC_STOP:
+    case IOC_SET_BITRATE:
+    case IOC_SET_SJW_INCREMENT:
+    case IOC_SET_FILTER:
+    case IOC_CLEAR_FILTERS:
+    case IOC_RESET_TIMESTAMP:
+    case IOC_GET_ERR_STAT:
+    case IOC_CLEAR_ERR_STAT:
+	break;
+    default:
+	return -EINVAL;
+    }
+    if(cmd->priority>=HCAN_PRIO_COUNT)
+	return -EINVAL;
+
+    acmd=kzalloc(sizeof(*acmd),GFP_KERNEL);
+    if(!acmd)
+	return -ENOMEM;
+    acmd->owner=hf;
+    acmd->cmd=*cmd;
+    acmd->result.tag=cmd->tag;
+    acmd->result.ioctl=cmd->ioctl;
+
+    spin_lock(&hf->lock);
+    if(hf->count>=HCAN_CMD_MAX){
+	spin_unlock(&hf->lock);
+	kfree(acmd);
+	return -EAGAIN;
+    }
+    hf->count++;
+    spin_unlock(&hf->lock);
+
+    spin_lock(&board->acmd_lock);
+    list_add_tail(&acmd->list,&board->acmd_queue[cmd->priority]);
+    spin_unlock(&board->acmd_lock);
 
-int board_count=0;
+    schedule_work(&board->acmd_work);
+    return 0;
+}
 
+static int file_acmd_result(struct hcan_file *hf, struct hcan_cmd_result *res)
+{
+    struct hcan_acmd *acmd=NULL;
+
+    spin_lock(&hf->lock);
+    if(!list_empty(&hf->results)){
+	acmd=list_first_entry(&hf->results,struct hcan_acmd,list);
+	list_del(&acmd->list);
+	hf->count--;
+    }
+    spin_unlock(&hf->lock);
 
+    if(!acmd)
+	return -EAGAIN;
 
-void reset_mode(struct hcan_board *board, int status)
+    *res=acmd->result;
+    kfree(acmd);
+    return 0;
+}
+
+static int file_acmd_eventfd(struct hcan_file *hf, int fd)
 {
-    uint32_t val;
-    
-    /* CNTRL[30] is reset */
-    
-    val=readl(board->cfg_base+0x50);
-    
-    if(status){
-	val|=(1<<30);
-    } else {
-	val&=~(1<<30);
+    struct eventfd_ctx *ctx=NULL,*old;
+
+    if(fd>=0){
+	ctx=eventfd_ctx_fdget(fd);
+	if(IS_ERR(ctx))
+	    return PTR_ERR(ctx);
     }
 
-    writel(val,board->cfg_base+0x50);
+    spin_lock(&hf->lock);
+    old=hf->eventfd;
+    hf->eventfd=ctx;
+    spin_unlock(&hf->lock);
 
+    if(old)
+	eventfd_ctx_put(old);
+    return 0;
 }
 
-void set_fw_update_enable_pin(struct hcan_board *board, int state)
+static int board_acmd_busy(struct hcan_board *board, struct hcan_file *hf)
 {
-    uint32_t val;
+    int busy;
 
-    /* GPIO control register is at 0x54 */
-    
-    val=readl(board->cfg_base+0x54);
+    spin_lock(&board->acmd_lock);
+    busy=board->acmd_running && board->acmd_running->owner==hf;
+    spin_unlock(&board->acmd_lock);
 
-    if(state){
-	val|=(1<<2);
-    } else {
-	val&=~(1<<2);
+    return busy;
+}
+
+/* Drop the commands of a file which is closed. A command which is being
+ * carried out is finished first */
+static void file_acmd_release(struct hcan_file *hf)
+{
+    struct hcan_board *board=hf->node->board;
+    struct hcan_acmd *acmd,*tmp;
+    int p;
+
+    spin_lock(&board->acmd_lock);
+    hf->closing=1;
+    for(p=0;p<HCAN_PRIO_COUNT;p++){
+	list_for_each_entry_safe(acmd,tmp,&board->acmd_queue[p],list){
+	    if(acmd->owner==hf){
+		list_del(&acmd->list);
+		kfree(acmd);
+	    }
+	}
     }
+    spin_unlock(&board->acmd_lock);
 
-    writel(val,board->cfg_base+0x54);
+    wait_event(board->ev_acmd,!board_acmd_busy(board,hf));
 
+    list_for_each_entry_safe(acmd,tmp,&hf->results,list){
+	list_del(&acmd->list);
+	kfree(acmd);
+    }
+    if(hf->eventfd)
+	eventfd_ctx_put(hf->eventfd);
 }
 
-int error_map[]={
-    [E_OK] = 0,
-    [E_INVARG] = -EINVAL,
-    [E_INVCMD] = -EINVAL,
-    [E_IGNORED] = -EBUSY,
-};
+/* Messages in a DPM queue of the node. In bypass mode the application moves
+ * the pointer which the host copy is of, so both come from the DPM */
+static int node_buf_message_cnt(struct hcan_node *node, struct buffer *buf)
+{
+    if(node->bypass)
+	return buf_dpm_message_cnt(buf);
+    return buf_message_cnt(buf);
+}
 
-int board_cmd(struct hcan_board *board, uint16_t msg_code, 
-	uint32_t arg1, uint32_t arg2, uint32_t *retval)
+/* Fill in the answer to IOC_GET_NODE_STATUS. The DPM status areas are
+ * read with one copy each and decoded from there */
+static void node_get_status(struct hcan_node *node, struct node_status *st)
 {
-    int ret=0;
-    int saved;
+    struct hcan_board *board=node->board;
+    struct dpm_status ds;
+    struct can_status cs;
+    struct board_status bs;
+    unsigned long flags;
+
+    BUILD_BUG_ON(sizeof(st->dpm_can_status)!=sizeof(cs));
+    BUILD_BUG_ON(sizeof(st->dpm_board_status)!=sizeof(bs));
+
+    board_get_status(board,&ds);
+    cs=ds.can_status[node->number];
+    bs=ds.board_status;
+
+    memset(st,0,sizeof(*st));
+    st->version=NODE_STATUS_VERSION;
+    st->mode=le16_to_cpu(cs.mode);
+    st->can_status=cs.can_gsr|(cs.can_rxerr<<16)|(cs.can_txerr<<24);
+    st->board_status=(le16_to_cpu(bs.fw_running)<<16)|le16_to_cpu(bs.error);
+    st->iopin=cs.iopin;
+    st->bitrate=le16_to_cpu(cs.bitrate_i);
+    st->can_type=cs.can_type;
+    st->msgs_in_rxbuf=node_buf_message_cnt(node,&node->dpm_rxbuf)+le16_to_cpu(cs.msgs_in_sram);
+    st->msgs_in_txbuf=node_buf_message_cnt(node,&node->dpm_txbuf);
+
+    if(node->rx_fifo.msgs){
+	spin_lock_irqsave(&node->rx_fifo.lock,flags);
+	fifo_sync_tail(&node->rx_fifo);
+	st->rx_fifo_level=FIFO_LEVEL(&node->rx_fifo);
+	st->rx_fifo_max_level=node->rx_fifo.max_level;
+	st->rx_fifo_dropped=node->rx_fifo.dropped;
+	spin_unlock_irqrestore(&node->rx_fifo.lock,flags);
+	st->msgs_in_rxbuf+=st->rx_fifo_level;
+    }
+    if(node->tx_queue.msgs){
+	st->tx_queue_level=node_tx_pending(node);
+	st->msgs_in_txbuf+=st->tx_queue_level;
+    }
 
+    st->irq_handled=board->irq_handled;
+    st->irq_rejected=board->irq_rejected;
+    st->recoveries=board->recoveries;
 
-    /* aquire board semaphore. Only one command allowed at a time */
-    if(down_interruptible(&board->sem)){
-	return -ERESTARTSYS;
-    }
-    
-    iowrite32(arg1,&board->dpm->args[0]);
-    iowrite32(arg2,&board->dpm->args[1]);
+    memcpy(st->dpm_can_status,&cs,sizeof(cs));
+    memcpy(st->dpm_board_status,&bs,sizeof(bs));
+}
 
-    /* Wait for an answer */
-    board->cmd_ack=0;
+/* Bring the status page of a node up to date. Only the status timer of
+ * the board writes the page */
+static void node_update_status_page(struct hcan_node *node)
+{
+    struct hcan_status_page *page=node->status_page;
+    struct node_status st;
+    struct can_status *cs=(struct can_status *)st.dpm_can_status;
+    uint16_t counts[3];
+    int i;
 
-    saved=ioread16(&board->dpm->board_status.cmd_ack_cnt);
+    node_get_status(node,&st);
+    counts[0]=le16_to_cpu(cs->received);
+    counts[1]=le16_to_cpu(cs->sent);
+    counts[2]=le16_to_cpu(cs->filtered);
 
-    barrier();
-    /* Put the message in the mailbox. This will generate interrupt on the
-     * board */
-    iowrite16(msg_code,&board->dpm->mb_host2hico);
-    
-    if(wait_event_timeout(board->ev_cmd_ack, board->cmd_ack, board->cmd_timeout)==0){
-	printk(KERN_INFO "%s: No ack from board %s - timed out\n",
-		__FUNCTION__,pci_name(board->pdev));
-	ret= -EIO;
-	goto out;
+    page->seq++;
+    smp_wmb();
+
+    page->stamp_ns=ktime_get_ns();
+    if(node->counts_valid){
+	page->received+=(uint16_t)(counts[0]-node->last_counts[0]);
+	page->sent+=(uint16_t)(counts[1]-node->last_counts[1]);
+	page->filtered+=(uint16_t)(counts[2]-node->last_counts[2]);
     }
+    page->status=st;
 
+    smp_wmb();
+    page->seq++;
 
-    /* Get the return value from the error cell */
-    ret=ioread16(&board->dpm->args[0]);
-    ret|=ioread16( ((uint16_t *)&board->dpm->args[0])+1 )<<16;
-    if(ret>sizeof(error_map)/4){
-	printk(KERN_WARNING "%s: invalid return value %d for command %d\n",
-		__FUNCTION__,ret,msg_code);
-	ret=-EIO;
-    } else {
-	ret=error_map[ret];
+    for(i=0;i<3;i++){
+	node->last_counts[i]=counts[i];
     }
+    node->counts_valid=(st.board_status>>16)==FW2_RUNNING;
+}
 
-    /* FIXME: Give the FW some time to update DPM variables. We get an ACK sooner
-     * than they are all updated in main() of FW. This should be fixed in the
-     * firmware */
-    msleep(1);
-    if(retval!=NULL){
-	*retval=ioread32(&board->dpm->args[1]);
+static enum hrtimer_restart board_status_timer(struct hrtimer *timer)
+{
+    struct hcan_board *board=container_of(timer,struct hcan_board,status_timer);
+    int i;
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	if(board->node[i].status_page){
+	    node_update_status_page(&board->node[i]);
+	}
     }
 
-out:
-    /* free board semaphore */
-    up(&board->sem);
-    return ret;
+    hrtimer_forward_now(timer,board->status_period);
+    return HRTIMER_RESTART;
+}
 
+static void board_free(struct kref *ref)
+{
+    kfree(container_of(ref,struct hcan_board,ref));
 }
 
-int node_cmd(struct hcan_node *node, uint16_t cmd, 
-	uint32_t arg1, uint32_t arg2,uint32_t *retval)
+/* Drop a reference to the board. The last one is given up by
+ * hcan_pci_remove() or by closing the last mapping after that */
+static void board_put(struct hcan_board *board)
 {
-    /* Check that the firmware is running */
-    if(ioread16(&node->board->dpm->board_status.fw_running)!=FW2_RUNNING){
-	printk(KERN_WARNING "%s: Firmware fw2 not running on board %s (fw_running=%04x)\n",
-		__FUNCTION__,pci_name(node->board->pdev),
-		ioread16(&node->board->dpm->board_status.fw_running));
-	return -EIO;
+    kref_put(&board->ref,board_free);
+}
+
+/* The status timer runs while any status page of the board is mapped */
+static void hcan_status_vma_open(struct vm_area_struct *vma)
+{
+    struct hcan_board *board=vma->vm_private_data;
+
+    kref_get(&board->ref);
+    mutex_lock(&board->status_lock);
+    if(board->status_maps++==0 && !board->removed){
+	hrtimer_start(&board->status_timer,ktime_set(0,0),HRTIMER_MODE_REL);
     }
-    /* put the CAN node number into the command */
-    cmd= (cmd&0xff)|(node->number<<8);
+    mutex_unlock(&board->status_lock);
+}
+
+static void hcan_status_vma_close(struct vm_area_struct *vma)
+{
+    struct hcan_board *board=vma->vm_private_data;
 
-    return board_cmd(node->board, cmd, arg1, arg2, retval);
+    mutex_lock(&board->status_lock);
+    if(--board->status_maps==0){
+	hrtimer_cancel(&board->status_timer);
+    }
+    mutex_unlock(&board->status_lock);
+    board_put(board);
 }
 
+static const struct vm_operations_struct hcan_status_vm_ops = {
+    .open = hcan_status_vma_open,
+    .close = hcan_status_vma_close,
+};
+
 
 //int hcan_board_proc(char *buf, char **start, off_t offset, int count,
 //		      int *eof, void *data)
@@ -258,6 +1901,7 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
     
     struct hcan_board *board;
     board=PDE_DATA(file_inode(filp));
+    struct dpm_status st;
     struct board_status *bs;
     struct can_status *cs;
     char *str;
@@ -265,6 +1909,10 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
     uint16_t word;
     int first;
 
+    /* The firmware may be restarted by the fw1 version check */
+    if(wait_for_completion_interruptible(&board->fw_ready))
+	return -ERESTARTSYS;
+
     //FIXME: find a smarter way to avoid infinite reding.
     static bool readTwice;
     if(readTwice)
@@ -275,7 +1923,8 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
     readTwice=true;
     //ENDFIXME: find a smarter way to avoid infinite reding.
 
-    bs = &board->dpm->board_status;
+    board_get_status(board,&st);
+    bs = &st.board_status;
 
     len+=sprintf(buf+len,"\nboard %s\n",pci_name(board->pdev));
 
@@ -294,7 +1943,7 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 //    len+=sprintf(buf+len,"Linux driver: v%d (compiled on %s %s)\n",
 //           HCANPCI_DRIVER_VERSION,/*"Jan 01 2017","00:00:00");//;*/__DATE__,__TIME__);
 
-    word=ioread16(&bs->fw_running);
+    word=le16_to_cpu(bs->fw_running);
     switch(word){
 	case FW1_RUNNING: str="bootloader (fw1)"; break;
 	case FW2_RUNNING: str="firmware (fw2)"; break;
@@ -308,14 +1957,18 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 	return len;
     }
 
-    len+=sprintf(buf+len,"fw1 version: %d %s\n",board->fw1_version,
-	    (board->fw1_version==FW_DEBUG_VERSION)?"- debug release":"");
-    
-    len+=sprintf(buf+len,"fw1 date: %02d %02d.%02d.%02d\n",
-	    board->fw1_date[3],board->fw1_date[0],
-	    board->fw1_date[1],board->fw1_date[2]);
+    if(board->fw1_version<0){
+	len+=sprintf(buf+len,"fw1 version: unknown\n");
+    } else {
+	len+=sprintf(buf+len,"fw1 version: %d %s\n",board->fw1_version,
+		(board->fw1_version==FW_DEBUG_VERSION)?"- debug release":"");
+
+	len+=sprintf(buf+len,"fw1 date: %02d %02d.%02d.%02d\n",
+		board->fw1_date[3],board->fw1_date[0],
+		board->fw1_date[1],board->fw1_date[2]);
+    }
     
-    word=ioread16(&bs->fw_version);
+    word=le16_to_cpu(bs->fw_version);
     len+=sprintf(buf+len,"fw2 version: %d %s\n",word,
 	    (word==FW_DEBUG_VERSION)?"- debug release":"");
     if(word!=FW_DEBUG_VERSION && word<REQUIRED_FW2_VERSION){
@@ -326,16 +1979,16 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
     }
     
     len+=sprintf(buf+len,"fw2 date: %02d %02d.%02d.%02d\n",
-	    ioread8(&bs->fw_date[3]),
-	    ioread8(&bs->fw_date[0]),
-	    ioread8(&bs->fw_date[1]),
-	    ioread8(&bs->fw_date[2]));
-    len+=sprintf(buf+len,"lpcbc rev: 0x%0x\n",ioread16(&bs->lpcbc_rev));
+	    bs->fw_date[3],
+	    bs->fw_date[0],
+	    bs->fw_date[1],
+	    bs->fw_date[2]);
+    len+=sprintf(buf+len,"lpcbc rev: 0x%0x\n",le16_to_cpu(bs->lpcbc_rev));
 
     /* PCI eeprom version */
     len+=sprintf(buf+len,"pci rev: 0x%x\n",board->pci_eeprom_rev);
     
-    switch(ioread8(&bs->hw_id)){
+    switch(bs->hw_id){
 	case HW_HICOCAN_MPCI:
 	    str="HiCO.CAN-MiniPCI";
 	    break;
@@ -352,13 +2005,13 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 	    str="Invalid!";
 	    break;
     }
-    len+=sprintf(buf+len,"hardware id: 0x%x (%s)\n",ioread8(&bs->hw_id),str);
+    len+=sprintf(buf+len,"hardware id: 0x%x (%s)\n",bs->hw_id,str);
 
     for(i=0;i<NUMBER_OF_CAN_NODES;i++){
 	if(board->node[i].disabled) continue;
 
-	cs=board->node[i].can_status;
-	switch(ioread8(&cs->can_type)){
+	cs=&st.can_status[i];
+	switch(cs->can_type){
 	    case CAN_TYPE_EMPTY: str="empty - not populated"; break;
 	    case CAN_TYPE_HS: str="High Speed (HS)"; break;
 	    case CAN_TYPE_FT: str="Fault Tolerant (FT)"; break;
@@ -367,7 +2020,7 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 
 	len+=sprintf(buf+len,"can%d: %s - ",i,str);
 
-	switch(ioread8(&cs->mode)){
+	switch(le16_to_cpu(cs->mode)){
 	    case 1: str="baudscan"; break;
 	    case 2: str="passive"; break;
 	    case 3: str="active"; break;
@@ -375,20 +2028,20 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 	    default: str="invalid"; break;
 	}
 	len+=sprintf(buf+len,"%s ",str);
-	len+=sprintf(buf+len,"%dkbps ",((int)ioread16(&cs->bitrate)));
+	len+=sprintf(buf+len,"%dkbps ",((int)le16_to_cpu(cs->bitrate)));
 
-	byte=ioread8(&cs->can_gsr);
+	byte=cs->can_gsr;
 	len+=sprintf(buf+len,"%s%s%s\n",
 		byte&((1<<6)|(1<<7))?"":"ok",
 		byte&(1<<6)?"ErrPassive! ":"", 
 		byte&(1<<7)?"BusOff! ":"");
     }
 
-    word=ioread16(&bs->hw_id);
+    word=bs->hw_id;
     if((word==HW_HICOCAN_PCI104)||
 	    (word==HW_HICOCAN_UNKNOWN)){
 
-	byte=ioread8(&bs->pci104_pos);
+	byte=bs->pci104_pos;
 	len+=sprintf(buf+len,"pci104_pos: %d",byte);
 	if(byte > 3){
 	    len+=sprintf(buf+len," <- invalid!\n");
@@ -401,7 +2054,7 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 
 
 
-    word=ioread16(&bs->error);
+    word=le16_to_cpu(bs->error);
     switch(word){
 	case BE_OK:                  str=BE_OK_STR; break;
 	case BE_INV_FW_IMAGE_IN_DPM: str=BE_INV_FW_IMAGE_IN_DPM_STR; break;
@@ -418,7 +2071,9 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 
     /* exception string would have to converted to bigendian */
 #ifndef __BIG_ENDIAN
-    if(ioread16(&bs->fw_running)==EXCPT_RUNNING){
+    /* The status may be from before a restart which has just finished */
+    down_read(&board->restart_sem);
+    if(le16_to_cpu(bs->fw_running)==EXCPT_RUNNING && board->fw_state==EXCPT_RUNNING){
 	if(board_cmd(board, CMD_PRINT_EXCEPTION, 0, 0,NULL)){
 	    len+=sprintf(buf+len,"failed to get exception string\n");
 	} else {
@@ -434,10 +2089,33 @@ static ssize_t hcan_board_read(struct file *filp,   /* see include/linux/fs.h
 	    }
 	}
     }
+    up_read(&board->restart_sem);
 #endif
 
-    len+=sprintf(buf+len,"interrupt: %d\n",
-	    board->pdev->irq);
+    if(poll_rate){
+	len+=sprintf(buf+len,"interrupt: none, polled %u times/s\n",
+		min_t(unsigned int,poll_rate,POLL_RATE_MAX));
+    } else {
+	len+=sprintf(buf+len,"interrupt: %d\n",
+		board->pdev->irq);
+    }
+    len+=sprintf(buf+len,"interrupts: %lu handled, %lu not ours, "
+	    "handler time avg %llu ns max %llu ns\n",
+	    board->irq_handled,board->irq_rejected,
+	    board->irq_handled ?
+	    (unsigned long long)div_u64(board->irq_ns_total,board->irq_handled) : 0ULL,
+	    (unsigned long long)board->irq_ns_max);
+    if(irq_poll){
+	len+=sprintf(buf+len,"interrupt thread: %lu poll passes\n",
+		board->poll_passes);
+    }
+
+    mutex_lock(&board->recover_lock);
+    len+=sprintf(buf+len,"recoveries: %lu\n",board->recoveries);
+    if(board->excpt_text){
+	len+=sprintf(buf+len,"last exception:\n%s",board->excpt_text);
+    }
+    mutex_unlock(&board->recover_lock);
 
     //*eof = 1;
     return len;
@@ -450,13 +2128,14 @@ static ssize_t hcan_node_read(struct file *filp,   /* see include/linux/fs.h   *
                            size_t length,       /* length of the buffer     */
                            loff_t * offset)
 {
-    int len = 0;
+    int len = 0,n;
     
     char *mode=NULL,*type=NULL;
     struct hcan_node *node;
     node=PDE_DATA(file_inode(filp));
     struct hcan_board *board = node->board;
-    struct can_status *cs=node->can_status;
+    struct dpm_status st;
+    struct can_status *cs=&st.can_status[node->number];
     uint8_t byte;
 
     //FIXME: find a smarter way to avoid infinite reding.
@@ -469,7 +2148,9 @@ static ssize_t hcan_node_read(struct file *filp,   /* see include/linux/fs.h   *
     readTwice=true;
     //ENDFIXME: find a smarter way to avoid infinite reding.
 
-    switch(ioread16(&cs->mode)){
+    board_get_status(board,&st);
+
+    switch(le16_to_cpu(cs->mode)){
 	case 1: mode="baudscan"; break;
 	case 2: mode="passive"; break;
 	case 3: mode="active"; break;
@@ -480,7 +2161,7 @@ static ssize_t hcan_node_read(struct file *filp,   /* see include/linux/fs.h   *
     len+=sprintf(buf+len,"can%d: node %d on board %s\n",node->minor,node->number,
 	    pci_name(board->pdev));
 
-    switch(ioread8(&cs->can_type)){
+    switch(cs->can_type){
 	case CAN_TYPE_EMPTY: type="empty - not populated"; break;
 	case CAN_TYPE_HS: type="High Speed (HS)"; break;
 	case CAN_TYPE_FT: type="Fault Tolerant (FT)"; break;
@@ -490,18 +2171,18 @@ static ssize_t hcan_node_read(struct file *filp,   /* see include/linux/fs.h   *
     len+=sprintf(buf+len,"type: %s\n",type);
     len+=sprintf(buf+len,"mode: %s\n",mode);
     
-    len+=sprintf(buf+len,"bitrate: %dkbps\n",((int)ioread16(&cs->bitrate)));
+    len+=sprintf(buf+len,"bitrate: %dkbps\n",((int)le16_to_cpu(cs->bitrate)));
 
-    byte=ioread8(&cs->can_gsr);
+    byte=cs->can_gsr;
     len+=sprintf(buf+len,"status: %x - %s%s%s\n",
 	    byte,
 	    byte&((1<<6)|(1<<7))?"":"ok",
 	    byte&(1<<6)?"ErrPassive! ":"", 
 	    byte&(1<<7)?"BusOff! ":"");
 
-    len+=sprintf(buf+len,"iopin: %x", ioread8(&cs->iopin));
-    if(ioread8(&cs->can_type) == CAN_TYPE_FT){
-	if(ioread8(&cs->iopin)==0){
+    len+=sprintf(buf+len,"iopin: %x", cs->iopin);
+    if(cs->can_type == CAN_TYPE_FT){
+	if(cs->iopin==0){
 	    len+=sprintf(buf+len," <- line error!");
 	} else {
 	    len+=sprintf(buf+len," <- line ok");
@@ -510,26 +2191,64 @@ static ssize_t hcan_node_read(struct file *filp,   /* see include/linux/fs.h   *
     len+=sprintf(buf+len,"\n");
 
     len+=sprintf(buf+len,"errCnt tx/rx: %d/%d\n", 
-	    ioread8(&cs->can_txerr),ioread8(&cs->can_rxerr));
+	    cs->can_txerr,cs->can_rxerr);
 
+    n=node_buf_message_cnt(node,&node->dpm_txbuf);
     len+=sprintf(buf+len,"dpm Tx buf: %d/%d %s\n",
-	    buf_message_cnt(&node->dpm_txbuf),buf_real_size(&node->dpm_txbuf),
-	    buf_is_full(&node->dpm_txbuf)?"full!":"");
+	    n,buf_real_size(&node->dpm_txbuf),
+	    n==buf_real_size(&node->dpm_txbuf)?"full!":"");
 
+    n=node_buf_message_cnt(node,&node->dpm_rxbuf);
     len+=sprintf(buf+len,"dpm Rx buf: %d/%d %s\n",
-	    buf_message_cnt(&node->dpm_rxbuf),buf_real_size(&node->dpm_rxbuf),
-	    buf_is_full(&node->dpm_rxbuf)?"full!":"");
+	    n,buf_real_size(&node->dpm_rxbuf),
+	    n==buf_real_size(&node->dpm_rxbuf)?"full!":"");
+    len+=sprintf(buf+len,"dpm Rx reads: %lu messages in %lu bursts\n",
+	    node->rx_burst_msgs,node->rx_bursts);
+
+    if(node->rx_fifo.msgs){
+	len+=sprintf(buf+len,"host Rx fifo: %u/%u (max %u) dropped %llu %s\n",
+		FIFO_LEVEL(&node->rx_fifo),node->rx_fifo.size,
+		node->rx_fifo.max_level,
+		(unsigned long long)node->rx_fifo.dropped,
+		node->rx_fifo.policy==RX_FIFO_DROP_OLDEST?"(drop oldest)":"(drop newest)");
+	len+=sprintf(buf+len,"Rx coalescing: %u us/%u frames, %llu interrupts, "
+		"%llu timer polls got %llu frames, masked max %llu us\n",
+		node->coal.max_usecs,node->coal.max_frames,
+		(unsigned long long)node->coal.interrupts,
+		(unsigned long long)node->coal.timer_polls,
+		(unsigned long long)node->coal.frames_polled,
+		(unsigned long long)div_u64(node->coal.masked_ns_max,NSEC_PER_USEC));
+    }
+
+    if(node->tx_queue.msgs){
+	len+=sprintf(buf+len,"host Tx queue: %u/%u\n",
+		FIFO_LEVEL(&node->tx_queue),node->tx_queue.size);
+    }
+
+    if(node->busoff.policy!=BUSOFF_RECOVER_OFF || node->busoff.bus_offs){
+	len+=sprintf(buf+len,"bus off recovery: %s, %llu bus offs, %llu restarts, "
+		"%llu recoveries, avg %llu us max %llu us\n",
+		node->busoff.policy==BUSOFF_RECOVER_IMMEDIATE ? "immediate" :
+		node->busoff.policy==BUSOFF_RECOVER_BACKOFF ? "backoff" : "off",
+		(unsigned long long)node->busoff.bus_offs,
+		(unsigned long long)node->busoff.restarts,
+		(unsigned long long)node->busoff.recoveries,
+		node->busoff.recoveries ?
+		(unsigned long long)div64_u64(node->busoff.recovery_us_total,
+		    node->busoff.recoveries) : 0ULL,
+		(unsigned long long)node->busoff.recovery_us_max);
+    }
 
     len+=sprintf(buf+len,"sram Rx buf: %d/%d %s\n",
-	    ioread16(&cs->msgs_in_sram),
-	    ioread16(&cs->srambuf_size),
-	    (ioread16(&cs->msgs_in_sram)==ioread16(&cs->srambuf_size))?"full!":"");
+	    le16_to_cpu(cs->msgs_in_sram),
+	    le16_to_cpu(cs->srambuf_size),
+	    (le16_to_cpu(cs->msgs_in_sram)==le16_to_cpu(cs->srambuf_size))?"full!":"");
 
     len+=sprintf(buf+len,"rec/snt/flt: %d/%d/%d\n",
-	    ioread16(&cs->received),ioread16(&cs->sent),
-	    ioread16(&cs->filtered));
+	    le16_to_cpu(cs->received),le16_to_cpu(cs->sent),
+	    le16_to_cpu(cs->filtered));
 
-	    len+=sprintf(buf+len,"int_enable=%04x\n",ioread16(&board->dpm->int_enable));
+	    len+=sprintf(buf+len,"int_enable=%04x\n",board->int_enable);
 
     //*eof = 1;
     return len;
@@ -544,11 +2263,16 @@ static long hcan_ioctl(struct file *filp,
     struct hcan_node *node;
     struct can_filter filter;
     struct err_stat err_stat;
-    int timeout,ret=0,val,i;
+    struct dpm_status st;
+    struct can_status *cs;
+    int ret=0,val;
 
-    node = (struct hcan_node *) filp->private_data;
+    node = FILE_NODE(filp);
     board = (struct hcan_board *) node->board;
 
+    if(board->removed)
+	return -ENODEV;
+
     //check if a valid ioctl command for this driver
     if (_IOC_TYPE(cmd) != IOC_MAGIC)
 	return -ENOTTY;
@@ -557,37 +2281,24 @@ static long hcan_ioctl(struct file *filp,
 
     case IOC_RESET_BOARD:
 
-	/* Save the current int mask */
-	val=ioread16(&board->dpm->int_enable);
-
-	iowrite16(0,&board->dpm->board_status.fw_running);
-	reset_mode(board,1);
-	reset_mode(board,0);
-
-	/* Wait for the boot firmware to get up and running  */
-	timeout=100;
-	while(ioread16(&board->dpm->board_status.fw_running)!=FW2_RUNNING && timeout--){
-	    msleep(10);
-	    if(--timeout==0)break;
-	}
-	if(!timeout){
+	/* The nodes start over with the default configuration */
+	down_write(&board->restart_sem);
+	ret=board_restart(board);
+	board_cfg_clear(board);
+	up_write(&board->restart_sem);
+	if(ret){
 	    printk(KERN_WARNING "%s: IOC_RESET_BOARD: could not get firmware running board %s\n",
 		    __FUNCTION__,pci_name(board->pdev));
-	    ret = -EIO;
-	    break;
 	}
-
-	board->last_ack_count=ioread16(&board->dpm->board_status.cmd_ack_cnt);
-
-	/* restore the interupt mask */
-	iowrite16(val,&board->dpm->int_enable);
 	break;
 
 
     case IOC_GET_CAN_STATUS:
-	val=ioread8(&node->can_status->can_gsr);
-	val|=ioread8(&node->can_status->can_rxerr)<<16;
-	val|=ioread8(&node->can_status->can_txerr)<<24;
+	board_get_status(board,&st);
+	cs=&st.can_status[node->number];
+	val=cs->can_gsr;
+	val|=cs->can_rxerr<<16;
+	val|=cs->can_txerr<<24;
 	
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
@@ -596,7 +2307,8 @@ static long hcan_ioctl(struct file *filp,
 	break;
 
     case IOC_GET_CAN_TYPE:
-	val=ioread8(&node->can_status->can_type);
+	board_get_status(board,&st);
+	val=st.can_status[node->number].can_type;
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
@@ -604,8 +2316,9 @@ static long hcan_ioctl(struct file *filp,
 	break;
 
     case IOC_GET_BOARD_STATUS:
-	val=ioread16(&board->dpm->board_status.fw_running)<<16;
-	val|=ioread16(&board->dpm->board_status.error);
+	board_get_status(board,&st);
+	val=le16_to_cpu(st.board_status.fw_running)<<16;
+	val|=le16_to_cpu(st.board_status.error);
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
@@ -613,7 +2326,8 @@ static long hcan_ioctl(struct file *filp,
 	break;
 
     case IOC_GET_HW_ID:
-	val=ioread8(&board->dpm->board_status.hw_id);
+	board_get_status(board,&st);
+	val=st.board_status.hw_id;
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
@@ -621,7 +2335,8 @@ static long hcan_ioctl(struct file *filp,
 	break;
 
     case IOC_GET_PCI104_POS:
-	val=ioread8(&board->dpm->board_status.pci104_pos);
+	board_get_status(board,&st);
+	val=st.board_status.pci104_pos;
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
@@ -629,7 +2344,8 @@ static long hcan_ioctl(struct file *filp,
 	break;
 
     case IOC_GET_FW2_VERSION:
-	val=ioread16(&board->dpm->board_status.fw_version);
+	board_get_status(board,&st);
+	val=le16_to_cpu(st.board_status.fw_version);
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
@@ -643,7 +2359,8 @@ static long hcan_ioctl(struct file *filp,
 	}
 	break;
     case IOC_GET_LPCBC_REV:
-	val=ioread16(&board->dpm->board_status.lpcbc_rev);
+	board_get_status(board,&st);
+	val=le16_to_cpu(st.board_status.lpcbc_rev);
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
@@ -666,128 +2383,386 @@ static long hcan_ioctl(struct file *filp,
 	ret=node_cmd(node,CMD_SET_SJW_INCREMENT,val,0,NULL);
 	break;
     case IOC_GET_ERR_STAT:
-	for(i=0;i<0x3f;i++){
-	    ret=node_cmd(node,CMD_GET_ERR_STAT,i,0,&val);
+	if(mutex_lock_interruptible(&node->err_lock)){
+	    ret=-ERESTARTSYS;
+	    break;
+	}
+	ret=node_update_err_stat(node,0);
+	err_stat=node->err_stat;
+	mutex_unlock(&node->err_lock);
+	if(ret){
+	    break;
+	}
+	if (copy_to_user((uint32_t *)arg, &err_stat, sizeof(struct err_stat))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+    case IOC_GET_ERR_STAT_CACHED:
+	{
+	    struct err_stat_snapshot snap;
+
+	    if(copy_from_user(&snap, (void *)arg, sizeof(snap))){
+		ret = -EFAULT;
+		break;
+	    }
+	    if(mutex_lock_interruptible(&node->err_lock)){
+		ret=-ERESTARTSYS;
+		break;
+	    }
+	    ret=node_update_err_stat(node,(u64)snap.max_age_ms*NSEC_PER_MSEC);
+	    snap.age_ms=div_u64(ktime_get_ns()-node->err_stamp,NSEC_PER_MSEC);
+	    snap.refreshes=node->err_refreshes;
+	    snap.stat=node->err_stat;
+	    mutex_unlock(&node->err_lock);
 	    if(ret){
 		break;
 	    }
-	    err_stat.values[i]=val;
+	    if(copy_to_user((void *)arg, &snap, sizeof(snap))){
+		ret = -EFAULT;
+	    }
+	}
+	break;
+    case IOC_CLEAR_ERR_STAT:
+	ret=node_clear_err_stat(node);
+	break;
+
+#ifdef IOC_SET_MODE
+    case IOC_SET_MODE:
+	if(copy_from_user(&val, (void *)arg, sizeof(int))){
+	    ret = -EFAULT;
+	    break;
+	}
+	ret=node_cmd(node,CMD_SET_MODE,val,0,NULL);
+	break;
+#endif
+
+    case IOC_GET_BITRATE:
+	board_get_status(board,&st);
+	val=le16_to_cpu(st.can_status[node->number].bitrate_i);
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_GET_IOPIN_STATUS:
+	board_get_status(board,&st);
+	val=st.can_status[node->number].iopin;
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_START:
+	ret=node_set_mode(node,CM_ACTIVE);
+	break;
+
+    case IOC_START_BAUDSCAN:
+	ret=node_set_mode(node,CM_RESET);
+	if(ret==0) ret=node_set_mode(node,CM_BAUDSCAN);
+	break;
+
+    case IOC_START_PASSIVE:
+	ret=node_set_mode(node,CM_PASSIVE);
+	break;
+
+    case IOC_STOP:
+	ret=node_set_mode(node,CM_RESET);
+	break;
+
+    case IOC_GET_MODE:
+	board_get_status(board,&st);
+	val=le16_to_cpu(st.can_status[node->number].mode);
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_MSGS_IN_RXBUF:
+	val=node_buf_message_cnt(node,&node->dpm_rxbuf)+ioread16(&node->can_status->msgs_in_sram);
+	if(node->rx_fifo.msgs){
+	    val+=FIFO_LEVEL(&node->rx_fifo);
+	}
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_MSGS_IN_TXBUF:
+	val=node_buf_message_cnt(node,&node->dpm_txbuf);
+	if(node->tx_queue.msgs){
+	    val+=FIFO_LEVEL(&node->tx_queue);
+	}
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_GET_TXBUF_SIZE:
+	val=buf_real_size(&node->dpm_txbuf);
+	if(node->tx_queue.msgs){
+	    val+=node->tx_queue.size;
+	}
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_GET_RXBUF_SIZE:
+	val=buf_real_size(&node->dpm_rxbuf)+ioread16(&node->can_status->srambuf_size);
+	if(node->rx_fifo.msgs){
+	    val+=node->rx_fifo.size;
+	}
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+	    ret = -EFAULT;
+	    break;
+	}
+	break;
+
+    case IOC_SET_RX_FIFO_POLICY:
+	if(copy_from_user(&val, (void *)arg, sizeof(int))){
+	    ret = -EFAULT;
+	    break;
+	}
+	if(!node->rx_fifo.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	if(val!=RX_FIFO_DROP_NEWEST && val!=RX_FIFO_DROP_OLDEST){
+	    ret = -EINVAL;
+	    break;
+	}
+	node->rx_fifo.policy=val;
+	break;
+
+    case IOC_GET_RX_FIFO_STAT:
+	if(!node->rx_fifo.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	{
+	    struct rx_fifo_stat stat;
+	    unsigned long flags;
+
+	    spin_lock_irqsave(&node->rx_fifo.lock,flags);
+	    stat.size=node->rx_fifo.size;
+	    stat.level=FIFO_LEVEL(&node->rx_fifo);
+	    stat.max_level=node->rx_fifo.max_level;
+	    stat.policy=node->rx_fifo.policy;
+	    stat.dropped=node->rx_fifo.dropped;
+	    spin_unlock_irqrestore(&node->rx_fifo.lock,flags);
+
+	    if (copy_to_user((void *)arg, &stat, sizeof(stat))) {
+		ret = -EFAULT;
+		break;
+	    }
 	}
-	if (copy_to_user((uint32_t *)arg, &err_stat, sizeof(struct err_stat))) {
+	break;
+
+    case IOC_TX_QUEUE_DEPTH:
+	if(!node->tx_queue.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	val=node_tx_pending(node);
+	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
 	}
 	break;
-    case IOC_CLEAR_ERR_STAT:
-	ret=node_cmd(node,CMD_CLR_ERR_STAT,0,0,NULL);
-	break;
 
-#ifdef IOC_SET_MODE
-    case IOC_SET_MODE:
-	if(copy_from_user(&val, (void *)arg, sizeof(int))){
-	    ret = -EFAULT;
+    case IOC_TX_QUEUE_FLUSH:
+	if(!node->tx_queue.msgs){
+	    ret = -ENODEV;
 	    break;
 	}
-	ret=node_cmd(node,CMD_SET_MODE,val,0,NULL);
+	board_int_enable(board,node->tx_int);
+	if(wait_event_interruptible(node->ev_tx_ready,
+		    !node_tx_pending(node) && buf_is_empty(&node->dpm_txbuf))){
+	    ret = -ERESTARTSYS;
+	}
 	break;
-#endif
 
-    case IOC_GET_BITRATE:
-	val=ioread16(&node->can_status->bitrate_i);
+    case IOC_TX_QUEUE_ABORT:
+	if(!node->tx_queue.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	{
+	    unsigned long flags;
+
+	    spin_lock_irqsave(&node->tx_queue.lock,flags);
+	    fifo_sync_head(&node->tx_queue);
+	    val=FIFO_LEVEL(&node->tx_queue);
+	    node->tx_queue.tail=node->tx_queue.head;
+	    node->tx_queue.shared->tail=node->tx_queue.tail;
+	    spin_unlock_irqrestore(&node->tx_queue.lock,flags);
+	}
+	wake_up_interruptible(&node->ev_tx_ready);
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
 	}
 	break;
 
-    case IOC_GET_IOPIN_STATUS:
-	val=ioread8(&node->can_status->iopin);
+    case IOC_GET_TX_QUEUE_SIZE:
+	if(!node->tx_queue.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	val=node->tx_queue.size;
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
 	}
 	break;
 
-    case IOC_START:
-	ret=node_cmd(node,CMD_SET_MODE,CM_ACTIVE,0,NULL);
-
-	if(ret==0){
-	    if((val=ioread16(&node->can_status->mode))!=CM_ACTIVE){
-		printk(KERN_ERR "IOC_START: node in wrong mode %d\n",val);
-		ret=-EIO;
-	    }
+    case IOC_TX_RING_KICK:
+	if(!node->tx_queue.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	if(node->bypass){
+	    ret = -EBUSY;
+	    break;
+	}
+	if(board->fw_state!=FW2_RUNNING){
+	    ret = -EIO;
+	    break;
+	}
+	/* Let the Tx interrupt move what doesn't fit now */
+	if(node_fill_tx(node)){
+	    board_int_enable(board,node->tx_int);
 	}
 	break;
 
-    case IOC_START_BAUDSCAN:
-	ret=node_cmd(node,CMD_SET_MODE,CM_RESET,0,NULL);
-	if(ret==0) ret=node_cmd(node,CMD_SET_MODE,CM_BAUDSCAN,0,NULL);
+    case IOC_SET_RX_COALESCE:
+	{
+	    struct rx_coalesce coal;
+	    unsigned long flags;
 
-	if(ret==0){
-	    if((val=ioread16(&node->can_status->mode))!=CM_BAUDSCAN){
-		printk(KERN_ERR "IOC_START_BAUDSCAN: node in wrong mode %d\n",val);
-		ret=-EIO;
+	    if(copy_from_user(&coal, (void *)arg, sizeof(coal))){
+		ret = -EFAULT;
+		break;
+	    }
+	    if(!node->rx_fifo.msgs){
+		ret = -ENODEV;
+		break;
+	    }
+	    /* The DPM queue has to be able to hold what comes in meanwhile */
+	    if(coal.max_usecs>USEC_PER_SEC){
+		ret = -EINVAL;
+		break;
+	    }
+
+	    /* Back to plain interrupts first. An interrupt which still saw the
+	     * old setting may start the timer again after it has been
+	     * cancelled; it then finds coal_active cleared and stops */
+	    node->coal.max_usecs=0;
+	    hrtimer_cancel(&node->coal_timer);
+	    spin_lock_irqsave(&board->int_lock,flags);
+	    if(node->coal_active){
+		node->coal_active=0;
+		if(!node->bypass){
+		    __board_int_update(board,node->rx_int,0);
+		}
 	    }
+	    spin_unlock_irqrestore(&board->int_lock,flags);
+	    node->coal.max_frames=coal.max_frames;
+	    node->coal.max_usecs=coal.max_usecs;
 	}
 	break;
 
-    case IOC_START_PASSIVE:
-	ret=node_cmd(node,CMD_SET_MODE,CM_PASSIVE,0,NULL);
-	if(ret==0){
-	    if((val=ioread16(&node->can_status->mode))!=CM_PASSIVE){
-		printk(KERN_ERR "IOC_START_PASSIVE: node in wrong mode %d\n",val);
-		ret=-EIO;
-	    }
+    case IOC_GET_RX_COALESCE:
+	if(!node->rx_fifo.msgs){
+	    ret = -ENODEV;
+	    break;
+	}
+	if (copy_to_user((void *)arg, &node->coal, sizeof(node->coal))) {
+	    ret = -EFAULT;
+	    break;
 	}
 	break;
 
-    case IOC_STOP:
-	ret=node_cmd(node,CMD_SET_MODE,CM_RESET,0,NULL);
-	if(ret==0){
-	    if((val=ioread16(&node->can_status->mode))!=CM_RESET){
-		printk(KERN_ERR "IOC_STOP: node in wrong mode %d\n",val);
-		ret=-EIO;
+    case IOC_SET_BUSOFF_RECOVERY:
+	{
+	    struct busoff_recovery br;
+
+	    if(copy_from_user(&br, (void *)arg, sizeof(br))){
+		ret = -EFAULT;
+		break;
 	    }
+	    if(!busoff_settings_valid(&br)){
+		ret = -EINVAL;
+		break;
+	    }
+
+	    /* Start over with the new settings */
+	    cancel_delayed_work_sync(&board->busoff_work);
+	    node->busoff.policy=br.policy;
+	    node->busoff.delay_ms=br.delay_ms;
+	    node->busoff.max_delay_ms=br.max_delay_ms;
+	    node->busoff_stamp=0;
+	    node->busoff_delay=0;
+	    board_busoff_int_update(board);
+	    schedule_delayed_work(&board->busoff_work,0);
 	}
 	break;
 
-    case IOC_GET_MODE:
-	val=ioread16(&node->can_status->mode);
-	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+    case IOC_GET_BUSOFF_RECOVERY:
+	if (copy_to_user((void *)arg, &node->busoff, sizeof(node->busoff))) {
 	    ret = -EFAULT;
 	    break;
 	}
 	break;
 
-    case IOC_MSGS_IN_RXBUF:
-	val=buf_message_cnt(&node->dpm_rxbuf)+ioread16(&node->can_status->msgs_in_sram);
-	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
-	    ret = -EFAULT;
-	    break;
+    case IOC_GET_NODE_STATUS:
+	{
+	    struct node_status st;
+
+	    node_get_status(node,&st);
+	    if (copy_to_user((void *)arg, &st, sizeof(st))) {
+		ret = -EFAULT;
+	    }
 	}
 	break;
 
-    case IOC_MSGS_IN_TXBUF:
-	val=buf_message_cnt(&node->dpm_txbuf);
-	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
+    case IOC_SET_BYPASS:
+	if(copy_from_user(&val, (void *)arg, sizeof(int))){
 	    ret = -EFAULT;
 	    break;
 	}
+	if(node->dpm_rxbuf.base==NULL || node->dpm_txbuf.base==NULL){
+	    ret = -ENODEV;
+	    break;
+	}
+	ret=node_set_bypass(node,filp,val);
 	break;
 
-    case IOC_GET_TXBUF_SIZE:
-	val=buf_real_size(&node->dpm_txbuf);
+    case IOC_GET_NODE_NUMBER:
+	val=node->number;
 	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
 	    ret = -EFAULT;
 	    break;
 	}
 	break;
 
-    case IOC_GET_RXBUF_SIZE:
-	val=buf_real_size(&node->dpm_rxbuf)+ioread16(&node->can_status->srambuf_size);
-	if (copy_to_user((uint32_t *)arg, &val, sizeof(uint32_t))) {
-	    ret = -EFAULT;
-	    break;
+    case IOC_GET_PCI_NAME:
+	{
+	    char name[HCAN_PCI_NAME_LEN];
+
+	    memset(name,0,sizeof(name));
+	    strlcpy(name,pci_name(board->pdev),sizeof(name));
+	    if (copy_to_user((void *)arg, name, sizeof(name))) {
+		ret = -EFAULT;
+		break;
+	    }
 	}
 	break;
 
@@ -814,23 +2789,42 @@ static long hcan_ioctl(struct file *filp,
 	    break;
 	}
 
-	switch(filter.type){
-	case FTYPE_RANGE:
-	    ret=node_cmd(node,CMD_SET_RANGE_FILTER,filter.lower,filter.upper,NULL);
-	    break;
-	case FTYPE_AMASK:
-	    ret=node_cmd(node,CMD_SET_AMASK_FILTER,filter.mask,filter.code,NULL);
-	    break;
-	default:
-	    ret=-EINVAL;
-	    break;
-	}
-	iosetbits16(CF_FILTERS_ACTIVE, &node->can_status->flags2hico);
+	ret=node_set_filter(node,&filter);
 	break;
 
     case IOC_CLEAR_FILTERS:
-	ret=node_cmd(node,CMD_CLR_FILTERS,0,0,NULL);
-	ioclrbits16(CF_FILTERS_ACTIVE, &node->can_status->flags2hico);
+	ret=node_clear_filters(node);
+	break;
+
+    case IOC_CMD_SUBMIT:
+	{
+	    struct hcan_cmd acmd;
+
+	    if(copy_from_user(&acmd,(void *)arg,sizeof(acmd))){
+		ret=-EFAULT;
+		break;
+	    }
+	    ret=file_acmd_submit(filp->private_data,&acmd);
+	}
+	break;
+
+    case IOC_CMD_RESULT:
+	{
+	    struct hcan_cmd_result res;
+
+	    ret=file_acmd_result(filp->private_data,&res);
+	    if(ret==0 && copy_to_user((void *)arg,&res,sizeof(res))){
+		ret=-EFAULT;
+	    }
+	}
+	break;
+
+    case IOC_CMD_EVENTFD:
+	if(copy_from_user(&val, (void *)arg, sizeof(int))){
+	    ret = -EFAULT;
+	    break;
+	}
+	ret=file_acmd_eventfd(filp->private_data,val);
 	break;
 
     default:
@@ -844,18 +2838,34 @@ static long hcan_ioctl(struct file *filp,
 
 
 /* Write firmware into the board */
+/* Take the version of the boot firmware, while it is running */
+static void board_read_fw1_version(struct hcan_board *board)
+{
+    board->fw1_version = ioread16(&board->dpm->board_status.fw_version);
+    board->fw1_date[0] = ioread8(&board->dpm->board_status.fw_date[0]);
+    board->fw1_date[1] = ioread8(&board->dpm->board_status.fw_date[1]);
+    board->fw1_date[2] = ioread8(&board->dpm->board_status.fw_date[2]);
+    board->fw1_date[3] = ioread8(&board->dpm->board_status.fw_date[3]);
+}
+
 ssize_t hcan_fw_write(struct file *filp, const char __user *buf, size_t count, loff_t *fpos)
 {
-    struct hcan_node *node=filp->private_data;
+    struct hcan_node *node=FILE_NODE(filp);
     struct hcan_board *board=node->board;
     uint8_t *data=NULL,*rptr;
     int ret=0;
     int blocks,block_nr=0;
-    unsigned long timeout;
+    uint16_t int_enable;
 
     blocks=count/FW_UPDATE_BLOCK_SIZE;
     if(count%FW_UPDATE_BLOCK_SIZE) blocks ++;
 
+    down_write(&board->restart_sem);
+
+    /* The boot firmware only gets command ack interrupts, the new firmware
+     * gets the ones which were enabled before */
+    int_enable=board->int_enable;
+
     data=kmalloc(blocks*FW_UPDATE_BLOCK_SIZE, GFP_KERNEL);
     if(!data){
 	ret = -ENOMEM;
@@ -875,6 +2885,7 @@ ssize_t hcan_fw_write(struct file *filp, const char __user *buf, size_t count, l
 
     /* Reset the firmware running status variable */
     iowrite16(0,&board->dpm->board_status.fw_running);
+    board->fw_state=0;
 
     /* Set PCI reset active */
     reset_mode(board,1);
@@ -886,21 +2897,19 @@ ssize_t hcan_fw_write(struct file *filp, const char __user *buf, size_t count, l
     reset_mode(board,0);
 
     /* Wait for the boot firmware to get up and running  */
-    timeout=100;
     iowrite16(0,&board->dpm->board_status.fw_running);
-    while(ioread16(&board->dpm->board_status.fw_running)!=FW1_RUNNING){
-	msleep(10);
-	if(--timeout==0)break;
-    }
-    if(!timeout){
+    if(board_wait_fw(board,FW1_RUNNING)){
 	printk(KERN_WARNING "%s: Boot firmware not running on board %s\n",
 		__FUNCTION__,pci_name(board->pdev));
 	ret=-EIO;
 	goto out;
     }
 
+    /* The boot firmware is running anyway */
+    board_read_fw1_version(board);
+
     /* Enable command ack interrupts */
-    iowrite16(INT_CMD_ACK,&board->dpm->int_enable);
+    board_int_write(board,INT_CMD_ACK);
 
     block_nr=0;
     while(blocks){
@@ -928,12 +2937,7 @@ ssize_t hcan_fw_write(struct file *filp, const char __user *buf, size_t count, l
     }
 
     /* Wait for the new firmware to get running  */
-    timeout=100;
-    while(ioread16(&board->dpm->board_status.fw_running)!=FW2_RUNNING ){
-	msleep(10);
-	if(--timeout==0) break;
-    }
-    if(!timeout){
+    if(board_wait_fw(board,FW2_RUNNING)){
 	printk(KERN_WARNING "%s: Application firmware not running on board %s\n",
 		__FUNCTION__,pci_name(board->pdev));
 	ret=-EIO;
@@ -946,6 +2950,10 @@ ssize_t hcan_fw_write(struct file *filp, const char __user *buf, size_t count, l
 out:
     if(data) kfree(data);
     set_fw_update_enable_pin(board, 0);
+    board_int_write(board,int_enable);
+    board_fw_restarted(board);
+    board_cfg_clear(board);
+    up_write(&board->restart_sem);
     return ret;
 }
 
@@ -954,10 +2962,12 @@ out:
 int get_fw1_version(struct hcan_board *board)
 {
     int ret=0;
-    unsigned long timeout;
+
+    down_write(&board->restart_sem);
 
     /* Reset the firmware running status variable */
     iowrite16(0,&board->dpm->board_status.fw_running);
+    board->fw_state=0;
 
     /* Set PCI reset active */
     reset_mode(board,1);
@@ -969,189 +2979,725 @@ int get_fw1_version(struct hcan_board *board)
     reset_mode(board,0);
 
     /* Wait for the boot firmware to get up and running  */
-    timeout=100;
     iowrite16(0,&board->dpm->board_status.fw_running);
-    while(ioread16(&board->dpm->board_status.fw_running)!=FW1_RUNNING){
-	msleep(10);
-	if(--timeout==0)break;
-    }
-    if(!timeout){
+    if(board_wait_fw(board,FW1_RUNNING)){
 	printk(KERN_WARNING "%s: Boot firmware not running on board %s\n",
 		__FUNCTION__,pci_name(board->pdev));
 	ret=-EIO;
 	goto out;
     }
 
-    board->fw1_version = ioread16(&board->dpm->board_status.fw_version);
-    board->fw1_date[0] = ioread8(&board->dpm->board_status.fw_date[0]);
-    board->fw1_date[1] = ioread8(&board->dpm->board_status.fw_date[1]);
-    board->fw1_date[2] = ioread8(&board->dpm->board_status.fw_date[2]);
-    board->fw1_date[3] = ioread8(&board->dpm->board_status.fw_date[3]);
+    board_read_fw1_version(board);
+
+    set_fw_update_enable_pin(board, 0);
+
+    /* Set PCI reset active */
+    reset_mode(board,1);
+
+    /* turn on the board */
+    reset_mode(board,0);
+
+
+    /* Wait for the new firmware to get running  */
+    if(board_wait_fw(board,FW2_RUNNING)){
+	printk(KERN_WARNING "%s: Application firmware not running on board %s\n",
+		__FUNCTION__,pci_name(board->pdev));
+	ret=-EIO;
+	goto out;
+    }
+
+    ret = 0;
 
+out:
     set_fw_update_enable_pin(board, 0);
+    board_fw_restarted(board);
+    up_write(&board->restart_sem);
+    return ret;
+}
+
+/* Enable the interrupt sources and start the background work. Nothing of it
+ * may run while probe still restarts the board */
+static void board_start(struct hcan_board *board)
+{
+    int i;
+
+    /* A crash of the firmware is noticed right away. INT_ERROR is left to
+     * the bus off recovery */
+    if(auto_recover){
+	board_int_enable(board,INT_EXCEPION);
+    }
+
+    /* Start looking after the nodes which go bus off. A node whose
+     * settings were invalid starts without a policy */
+    board_busoff_int_update(board);
+    if(busoff_recovery!=BUSOFF_RECOVER_OFF){
+	schedule_delayed_work(&board->busoff_work,msecs_to_jiffies(BUSOFF_POLL_MS));
+    }
+
+    /* Nodes with a receive FIFO get all Rx interrupts */
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	struct hcan_node *node=&board->node[i];
+	if(!node->disabled && node->rx_fifo.msgs){
+	    board_int_enable(board,node->rx_int);
+	}
+    }
+
+    if(err_stat_refresh && !fw_update){
+	schedule_delayed_work(&board->err_work,msecs_to_jiffies(err_stat_refresh));
+    }
+}
+
+static void board_fw1_work(struct work_struct *work)
+{
+    struct hcan_board *board=container_of(work,struct hcan_board,fw1_work);
+
+    get_fw1_version(board);
+    board_start(board);
+    complete_all(&board->fw_ready);
+}
+
+/* Copy n messages, starting from unit pos, out of a DPM message queue into
+ * host memory. Every contiguous run of units is fetched with one burst
+ * (there are at most two because of the wrap around) and the little endian
+ * DPM fields are converted in RAM afterwards. Returns the number of bursts */
+static int dpm_read_msgs(BUF_UNIT *base, struct can_msg *dst,
+	int pos, int size, int n)
+{
+    int i,run,dlc,bursts=1;
+
+    run=min(n,size-pos);
+    memcpy_fromio(dst,base+pos,run*sizeof(BUF_UNIT));
+    if(run<n){
+	memcpy_fromio(dst+run,base,(n-run)*sizeof(BUF_UNIT));
+	bursts++;
+    }
+
+    for(i=0;i<n;i++){
+	dst[i].fi=le16_to_cpu(dst[i].fi);
+	dst[i].ts=le32_to_cpu(dst[i].ts);
+	dst[i].id=le32_to_cpu(dst[i].id);
+
+	/* Don't pass stale DPM contents behind the data to userspace */
+	dlc=MSG_DLC(&dst[i]);
+	if(dlc<8){
+	    memset(&dst[i].data[dlc],0,8-dlc);
+	}
+    }
+    return bursts;
+}
+
+/* Counterpart of dpm_read_msgs(). The messages in src are converted to the
+ * DPM byte order in place and then written to the units starting from pos
+ * with one burst per contiguous run. The write barrier makes sure that the
+ * data has reached the DPM before the caller publishes the write pointer,
+ * also when base is a write-combining mapping */
+static void dpm_write_msgs(BUF_UNIT *base, struct can_msg *src,
+	int pos, int size, int n)
+{
+    int i,run;
+
+    for(i=0;i<n;i++){
+	src[i].fi=cpu_to_le16(src[i].fi);
+	src[i].ts=cpu_to_le32(src[i].ts);
+	src[i].id=cpu_to_le32(src[i].id);
+    }
+
+    run=min(n,size-pos);
+    memcpy_toio(base+pos,src,run*sizeof(BUF_UNIT));
+    if(run<n){
+	memcpy_toio(base,src+run,(n-run)*sizeof(BUF_UNIT));
+    }
+
+    wmb();
+}
+
+/* Move all messages from the DPM receive queue of the node into its host
+ * FIFO. If they don't all fit, the FIFO policy decides whether the oldest
+ * messages in the FIFO or the newest ones from the DPM are thrown away.
+ * Returns the number of messages taken out of the DPM */
+static int node_drain_rx(struct hcan_node *node)
+{
+    struct hcan_fifo *fifo=&node->rx_fifo;
+    struct buffer *buf=&node->dpm_rxbuf;
+    unsigned long flags;
+    unsigned int space,keep,done,run,idx;
+    int n;
+
+    spin_lock_irqsave(&fifo->lock,flags);
+
+    n=buf_message_cnt(buf);
+    if(n>0){
+	fifo_sync_tail(fifo);
+
+	keep=n;
+	space=fifo->size-FIFO_LEVEL(fifo);
+	if(n>space){
+	    /* The tail of a mapped ring belongs to the application, so it
+	     * always drops the newest messages */
+	    if(fifo->policy==RX_FIFO_DROP_OLDEST && !atomic_read(&fifo->mapped)){
+		fifo->tail+=n-space;
+		fifo->shared->tail=fifo->tail;
+	    } else {
+		keep=space;
+	    }
+	    fifo->dropped+=n-space;
+	}
+
+	for(done=0;done<keep;done+=run){
+	    idx=fifo->head&(fifo->size-1);
+	    run=min(keep-done,fifo->size-idx);
+	    node->rx_bursts+=dpm_read_msgs(buf->base,&fifo->msgs[idx],
+		    (buf->rptr+done)%buf->size,buf->size,run);
+	    fifo->head+=run;
+	}
+
+	node->rx_burst_msgs+=keep;
+	buf_advance_rptr(buf,n);
+
+	if(FIFO_LEVEL(fifo)>fifo->max_level)
+	    fifo->max_level=FIFO_LEVEL(fifo);
+
+	/* Publish the messages to the application */
+	smp_wmb();
+	fifo->shared->head=fifo->head;
+	fifo->shared->dropped=fifo->dropped;
+    }
+
+    spin_unlock_irqrestore(&fifo->lock,flags);
+
+    return n;
+}
+
+/* Called after Rx messages of a node with a receive FIFO have been
+ * serviced from an interrupt. With coalescing on, the Rx interrupt is
+ * masked and the messages arriving in the next coal.max_usecs are picked up
+ * by the timer. Returns 1 if the Rx interrupt is now left to the timer */
+static int node_rx_coalesce(struct hcan_node *node)
+{
+    struct hcan_board *board=node->board;
+    unsigned long flags;
+
+    node->coal.interrupts++;
+
+    if(!node->coal.max_usecs)
+	return 0;
+
+    spin_lock_irqsave(&board->int_lock,flags);
+    if(!node->coal_active){
+	node->coal_active=1;
+	node->coal_start=ktime_get_ns();
+	__board_int_update(board,0,node->rx_int);
+	hrtimer_start(&node->coal_timer,
+		ns_to_ktime((u64)node->coal.max_usecs*NSEC_PER_USEC),
+		HRTIMER_MODE_REL);
+    }
+    spin_unlock_irqrestore(&board->int_lock,flags);
+
+    return 1;
+}
+
+/* End of a coalescing period. If at least coal.max_frames messages came in
+ * during it, the traffic is heavy and the interrupt stays masked for
+ * another period. Otherwise the Rx interrupt is enabled again */
+static enum hrtimer_restart node_coal_timer(struct hrtimer *timer)
+{
+    struct hcan_node *node=container_of(timer,struct hcan_node,coal_timer);
+    struct hcan_board *board=node->board;
+    unsigned long flags;
+    u64 masked;
+    int n;
+
+    /* Coalescing has been switched off meanwhile */
+    if(!node->coal_active)
+	return HRTIMER_NORESTART;
+
+    if(node->bypass){
+	spin_lock_irqsave(&board->int_lock,flags);
+	node->coal_active=0;
+	spin_unlock_irqrestore(&board->int_lock,flags);
+	return HRTIMER_NORESTART;
+    }
+
+    n=node_drain_rx(node);
+    if(n){
+	wake_up_interruptible(&node->ev_rx_ready);
+    }
+    node->coal.timer_polls++;
+    node->coal.frames_polled+=n;
+
+    if(node->coal.max_usecs && node->coal.max_frames && n>=node->coal.max_frames){
+	hrtimer_forward_now(timer,
+		ns_to_ktime((u64)node->coal.max_usecs*NSEC_PER_USEC));
+	return HRTIMER_RESTART;
+    }
+
+    /* How long the interrupt was off is the most a message has waited
+     * longer than without coalescing */
+    masked=ktime_get_ns()-node->coal_start;
+    node->coal.masked_ns_total+=masked;
+    if(masked>node->coal.masked_ns_max)
+	node->coal.masked_ns_max=masked;
+
+    spin_lock_irqsave(&board->int_lock,flags);
+    if(node->coal_active){
+	node->coal_active=0;
+	__board_int_update(board,node->rx_int,0);
+    }
+    spin_unlock_irqrestore(&board->int_lock,flags);
+
+    return HRTIMER_NORESTART;
+}
+
+/* Take up to max messages out of the FIFO */
+static int fifo_get(struct hcan_fifo *fifo, struct can_msg *dst, int max)
+{
+    unsigned long flags;
+    unsigned int idx;
+    int n,run;
+
+    spin_lock_irqsave(&fifo->lock,flags);
+
+    fifo_sync_tail(fifo);
+
+    n=min_t(unsigned int,FIFO_LEVEL(fifo),max);
+    idx=fifo->tail&(fifo->size-1);
+    run=min_t(unsigned int,n,fifo->size-idx);
+    memcpy(dst,&fifo->msgs[idx],run*sizeof(struct can_msg));
+    if(run<n){
+	memcpy(dst+run,fifo->msgs,(n-run)*sizeof(struct can_msg));
+    }
+    fifo->tail+=n;
+    if(fifo->shared){
+	fifo->shared->tail=fifo->tail;
+    }
+
+    spin_unlock_irqrestore(&fifo->lock,flags);
+
+    return n;
+}
+
+/* Put n messages at the head of the FIFO. The caller has checked that there
+ * is room for them */
+static void fifo_put(struct hcan_fifo *fifo, const struct can_msg *src, int n)
+{
+    unsigned long flags;
+    unsigned int idx;
+    int run;
+
+    spin_lock_irqsave(&fifo->lock,flags);
+
+    idx=fifo->head&(fifo->size-1);
+    run=min_t(unsigned int,n,fifo->size-idx);
+    memcpy(&fifo->msgs[idx],src,run*sizeof(struct can_msg));
+    if(run<n){
+	memcpy(fifo->msgs,src+run,(n-run)*sizeof(struct can_msg));
+    }
+    fifo->head+=n;
+    if(fifo->shared){
+	smp_wmb();
+	fifo->shared->head=fifo->head;
+    }
+
+    spin_unlock_irqrestore(&fifo->lock,flags);
+}
+
+/* Move as many messages from the transmit queue of the node into the DPM Tx
+ * buffer as there is room for. They are published with one write pointer
+ * update. Messages which the application has put into a mapped queue are
+ * picked up as well. Returns the number of messages left in the queue */
+static int node_fill_tx(struct hcan_node *node)
+{
+    struct hcan_fifo *txq=&node->tx_queue;
+    struct buffer *buf=&node->dpm_txbuf;
+    unsigned long flags;
+    unsigned int n,done,run,idx;
+    int left;
+
+    spin_lock_irqsave(&txq->lock,flags);
+
+    fifo_sync_head(txq);
+
+    n=min_t(unsigned int,FIFO_LEVEL(txq),buf_free_cnt(buf));
+    for(done=0;done<n;done+=run){
+	idx=txq->tail&(txq->size-1);
+	run=min(n-done,txq->size-idx);
+	dpm_write_msgs(node->tx_base,&txq->msgs[idx],
+		(buf->wptr+done)%buf->size,buf->size,run);
+	txq->tail+=run;
+    }
+    if(n){
+	buf_advance_wptr(buf,n);
+
+	/* Hand the units back to the application */
+	smp_mb();
+	txq->shared->tail=txq->tail;
+    }
+    left=FIFO_LEVEL(txq);
+
+    spin_unlock_irqrestore(&txq->lock,flags);
+
+    return left;
+}
+
+/* Number of CAN messages which are collected from the DPM on the kernel stack
+ * before they are copied to userspace in hcan_read() */
+#define RX_BATCH 16
+
+/* hcan_read() for nodes with a receive FIFO. The DPM queue is emptied by
+ * the interrupt handler, so only the FIFO is looked at here */
+static ssize_t hcan_read_fifo(struct file *filp, struct hcan_node *node,
+	char __user *buff, size_t frames)
+{
+    struct hcan_fifo *fifo=&node->rx_fifo;
+    struct can_msg batch[RX_BATCH];
+    size_t done=0;
+    int n,fault,ret;
+
+    /* Pick up messages whose interrupt might have been missed */
+    node_drain_rx(node);
+
+    /* Another reader may empty the FIFO between the wake up and taking
+     * rx_lock. Then it's back to waiting */
+    for(;;){
+	if(!FIFO_LEVEL(fifo)){
+
+	    /* return if the read is set as non-blocking */
+	    if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+
+	    /* Wait for data. Return with "restat sys command" error if the
+	     * process received a signal */
+	    if (wait_event_interruptible(node->ev_rx_ready,
+			node_data_path(node) || FIFO_LEVEL(fifo))){
+		return -ERESTARTSYS;
+	    }
+	}
+
+	if(mutex_lock_interruptible(&node->rx_lock)){
+	    return -ERESTARTSYS;
+	}
+	ret=node_data_path(node);
+	if(ret){
+	    mutex_unlock(&node->rx_lock);
+	    return ret;
+	}
 
-    /* Set PCI reset active */
-    reset_mode(board,1);
+	fault=0;
+	while(done<frames){
+	    n=fifo_get(fifo,batch,min_t(size_t,frames-done,RX_BATCH));
+	    if(!n) break;
 
-    /* turn on the board */
-    reset_mode(board,0);
+	    /* The messages are already out of the FIFO, so they are lost if
+	     * this fails */
+	    if (copy_to_user(buff+done*sizeof(struct can_msg), batch,
+			n*sizeof(struct can_msg))) {
+		fault=1;
+		break;
+	    }
+	    done+=n;
+	}
 
+	mutex_unlock(&node->rx_lock);
 
-    /* Wait for the new firmware to get running  */
-    timeout=100;
-    while(ioread16(&board->dpm->board_status.fw_running)!=FW2_RUNNING ){
-	msleep(10);
-	if(--timeout==0) break;
+	if(done)
+	    return done*sizeof(struct can_msg);
+	if(fault)
+	    return -EFAULT;
     }
-    if(!timeout){
-	printk(KERN_WARNING "%s: Application firmware not running on board %s\n",
-		__FUNCTION__,pci_name(board->pdev));
-	ret=-EIO;
-	goto out;
-    }
-
-    ret = 0;
-
-out:
-    set_fw_update_enable_pin(board, 0);
-    return ret;
 }
 
 ssize_t hcan_read(struct file *filp, char __user *buff, size_t count, loff_t *offp)
 {
-    struct hcan_node *node=filp->private_data;
+    struct hcan_node *node=FILE_NODE(filp);
     struct hcan_board *board=node->board;
-    struct can_msg _msg, *msg;
-    int ret,i;
+    struct can_msg batch[RX_BATCH];
+    size_t frames,done=0;
+    int n,avail,rptr,size,fault;
 
-    /* Only CAN telegrams can be read */
-    if (count != sizeof(struct can_msg))
+    if(board->removed)
+	return -ENODEV;
+
+    /* Only whole CAN telegrams can be read. The buffer may hold any number
+     * of them */
+    if (count < sizeof(struct can_msg) || count % sizeof(struct can_msg))
 	return -EINVAL;
+    frames=count/sizeof(struct can_msg);
     
-    if(ioread16(&board->dpm->board_status.fw_running)!=FW2_RUNNING){
+    if(board->fw_state!=FW2_RUNNING){
 	printk(KERN_WARNING "%s: Firmware no running on board %s (fw_running=%x)\n",
-		__FUNCTION__,pci_name(board->pdev),
-		ioread16(&board->dpm->board_status.fw_running));
+		__FUNCTION__,pci_name(board->pdev),board->fw_state);
 	return -EIO;
     }
 
-    if(buf_is_empty(&node->dpm_rxbuf)){
+    /* The application is using the DPM queues directly */
+    if(node->bypass)
+	return -EBUSY;
+
+    if(node->rx_fifo.msgs){
+	return hcan_read_fifo(filp,node,buff,frames);
+    }
 
-	/* return if the read is set as non-blocking */
-	if (filp->f_flags & O_NONBLOCK)
-	    return -EAGAIN;
+    /* Another reader may empty the buffer between the wake up and taking
+     * rx_lock. Then it's back to waiting */
+    for(;;){
+	if(buf_is_empty(&node->dpm_rxbuf)){
 
-	/* Enable rx interrupts */
-	iosetbits16(node->rx_int,&node->board->dpm->int_enable);
-    
-	/* Wait for data. Return with "restat sys command" error if the
-	 * process received a signal */
-	if (wait_event_interruptible(node->ev_rx_ready, buf_not_empty(&node->dpm_rxbuf))){
-	    return -ERESTARTSYS;	
+	    /* return if the read is set as non-blocking */
+	    if (filp->f_flags & O_NONBLOCK)
+		return -EAGAIN;
+
+	    /* Enable rx interrupts */
+	    board_int_enable(node->board,node->rx_int);
+
+	    /* Wait for data. Return with "restat sys command" error if the
+	     * process received a signal */
+	    if (wait_event_interruptible(node->ev_rx_ready,
+			node_data_path(node) || buf_not_empty(&node->dpm_rxbuf))){
+		return -ERESTARTSYS;
+	    }
+	}
+
+	/* Only one reader at a time may walk the receive buffer */
+	if(mutex_lock_interruptible(&node->rx_lock)){
+	    return -ERESTARTSYS;
+	}
+	n=node_data_path(node);
+	if(n){
+	    mutex_unlock(&node->rx_lock);
+	    return n;
+	}
+
+	/* Copy everything that is in the buffer (up to the number of
+	 * messages asked for) with one call. Don't block anymore once we've
+	 * got at least one message. */
+	fault=0;
+	while(done<frames){
+	    avail=buf_message_cnt(&node->dpm_rxbuf);
+	    if(!avail) break;
+
+	    n=min_t(size_t,frames-done,RX_BATCH);
+	    if(n>avail) n=avail;
+
+	    rptr=node->dpm_rxbuf.rptr;
+	    size=node->dpm_rxbuf.size;
+
+	    /* Copy the messages from the DPM into memory */
+	    node->rx_bursts+=dpm_read_msgs(node->dpm_rxbuf.base,batch,
+		    rptr,size,n);
+	    node->rx_burst_msgs+=n;
+
+	    /* Copy the CAN messages in userspace. Return value is a number
+	     * of bytes left to be copied, which has to be zero. The messages
+	     * stay in the DPM if the copy fails */
+	    if (copy_to_user(buff+done*sizeof(struct can_msg), batch,
+			n*sizeof(struct can_msg))) {
+		fault=1;
+		break;
+	    }
+
+	    /* Move the read pointer over the whole batch */
+	    buf_advance_rptr(&node->dpm_rxbuf,n);
+	    done+=n;
 	}
 
+	mutex_unlock(&node->rx_lock);
+
+	if(done)
+	    return done*sizeof(struct can_msg);
+
+	/* Report a fault only if nothing could be handed over */
+	if(fault)
+	    return -EFAULT;
     }
+}
 
-    /* Get the read pointer */
-    msg=(struct can_msg *)BUF_RPTR(&node->dpm_rxbuf);
+/* hcan_write() for nodes with a transmit queue. The messages are put into
+ * the queue, and as many of them as fit are moved into the DPM right away.
+ * The rest follow from the Tx interrupt */
+static ssize_t hcan_write_queue(struct file *filp, struct hcan_node *node,
+	const char __user *buf, size_t frames)
+{
+    struct hcan_fifo *txq=&node->tx_queue;
+    size_t done=0;
+    int ret=0,n;
 
-    /* Copy the message from the DPM into memory */
-    _msg.fi = ioread16(&msg->fi);
-    _msg.ts = ioread32(&msg->ts);
-    _msg.id = ioread32(&msg->id);
-    for(i=0;i<MSG_DLC(&_msg) && i<8;i++){
-	_msg.data[i] = ioread8(&msg->data[i]);
+    if(mutex_lock_interruptible(&node->tx_lock)){
+	return -ERESTARTSYS;
     }
 
+    while(done<frames){
+	ret=node_data_path(node);
+	if(ret){
+	    break;
+	}
+	n=txq->size-FIFO_LEVEL(txq);
 
-    /* Copy the CAN message in userspace. Return value is a number of bytes
-     * left to be copied, which has to be zero */
-    if (copy_to_user(buff, &_msg, sizeof(struct can_msg))) {
-	ret = -EFAULT;
-	goto out;
+	if(!n){
+	    if (filp->f_flags & O_NONBLOCK){
+		ret=-EAGAIN;
+		break;
+	    }
+
+	    board_int_enable(node->board,node->tx_int);
+
+	    if (wait_event_interruptible(node->ev_tx_ready,
+			node_data_path(node) || FIFO_LEVEL(txq)<txq->size)){
+		ret=-ERESTARTSYS;
+		break;
+	    }
+	    continue;
+	}
+
+	/* The staging buffer holds as many messages as the DPM Tx buffer */
+	n=min_t(size_t,n,frames-done);
+	n=min(n,node->dpm_txbuf.size);
+
+	if(copy_from_user(node->tx_stage,buf+done*sizeof(struct can_msg),
+		    n*sizeof(struct can_msg))){
+	    ret=-EFAULT;
+	    break;
+	}
+	fifo_put(txq,node->tx_stage,n);
+	done+=n;
+
+	node_fill_tx(node);
     }
 
-    /* Increment read pointer */
-    buf_increment_rptr(&node->dpm_rxbuf);
+    /* Let the Tx interrupt move the rest */
+    if(FIFO_LEVEL(txq)){
+	board_int_enable(node->board,node->tx_int);
+    }
 
-    ret=sizeof(struct can_msg);
+    mutex_unlock(&node->tx_lock);
+
+    if(done)
+	ret=done*sizeof(struct can_msg);
 
-out:
     return ret;
 }
 
 ssize_t hcan_write(struct file *filp, const char __user *buf, size_t count, loff_t *fpos)
 {
-    struct hcan_node *node=filp->private_data;
+    struct hcan_node *node=FILE_NODE(filp);
     struct hcan_board *board=node->board;
-    struct can_msg *msg,_msg;
-    int ret,i;
+    size_t frames,done=0;
+    int ret=0,room,wptr,size;
+
+    if(board->removed)
+	return -ENODEV;
 
     if(fw_update){
 	return hcan_fw_write(filp,buf,count,fpos);
     }
 
-    if(ioread16(&board->dpm->board_status.fw_running)!=FW2_RUNNING){
+    if(board->fw_state!=FW2_RUNNING){
 	printk(KERN_INFO "%s: Firmware no running on board %s (fw_running=%x)\n",
-		__FUNCTION__,pci_name(board->pdev),
-		ioread16(&board->dpm->board_status.fw_running));
+		__FUNCTION__,pci_name(board->pdev),board->fw_state);
 	return -EIO;
     }
 
-    /* Only CAN telegrams can be written */
-    if (count != sizeof(struct can_msg))
+    /* Only whole CAN telegrams can be written. The buffer may hold any
+     * number of them */
+    if (count < sizeof(struct can_msg) || count % sizeof(struct can_msg))
 	return -EINVAL;
+    frames=count/sizeof(struct can_msg);
+
+    /* The application is using the DPM queues directly */
+    if(node->bypass)
+	return -EBUSY;
 
-    if(buf_is_full(&node->dpm_txbuf)){
+    if(node->tx_queue.msgs){
+	/* A mapped queue is filled by the application only */
+	if(atomic_read(&node->tx_queue.mapped))
+	    return -EBUSY;
+	return hcan_write_queue(filp,node,buf,frames);
+    }
+
+    /* Only one writer at a time may fill the transmit buffer */
+    if(mutex_lock_interruptible(&node->tx_lock)){
+	return -ERESTARTSYS;
+    }
+
+    while(done<frames){
+	ret=node_data_path(node);
+	if(ret){
+	    break;
+	}
+	room=buf_free_cnt(&node->dpm_txbuf);
 
-	/* return if the read is set as non-blocking */
-	if (filp->f_flags & O_NONBLOCK)
-	    return -EAGAIN;
+	if(!room){
 
+	    /* return if the write is set as non-blocking. Whatever was
+	     * already written is reported as a partial write */
+	    if (filp->f_flags & O_NONBLOCK){
+		ret=-EAGAIN;
+		break;
+	    }
 
-	/* Enable Tx interrupts */
-	iosetbits16(node->tx_int,&node->board->dpm->int_enable);
+	    /* Enable Tx interrupts */
+	    board_int_enable(node->board,node->tx_int);
 
-	/* Wait for free space in the tx buffer. Return with "restat sys
-	 * command" error if the process received a signal */
-	if (wait_event_interruptible(node->ev_tx_ready, buf_not_full(&node->dpm_txbuf))){
-	    return -ERESTARTSYS;	
+	    /* Wait for free space in the tx buffer. Return with "restat sys
+	     * command" error if the process received a signal */
+	    if (wait_event_interruptible(node->ev_tx_ready,
+			node_data_path(node) || buf_not_full(&node->dpm_txbuf))){
+		ret=-ERESTARTSYS;
+		break;
+	    }
+	    continue;
+	}
+
+	if(room>frames-done) room=frames-done;
+
+	/* Copy the messages from user space.. */
+	if(copy_from_user(node->tx_stage,buf+done*sizeof(struct can_msg),
+		    room*sizeof(struct can_msg))){
+	    ret=-EFAULT;
+	    break;
 	}
-    }
-    
-    /* Get the write pointer */
-    msg=(struct can_msg *)BUF_WPTR(&node->dpm_txbuf);
-    
-    /* Copy the message from user space */
-    if(copy_from_user(&_msg,buf,sizeof(struct can_msg))){
-	ret=-EFAULT;
-	goto out;
-    }
 
-    /* ..write it into dpm.. */
-    iowrite16(_msg.fi,&msg->fi);
-    iowrite32(_msg.ts,&msg->ts);
-    iowrite32(_msg.id,&msg->id);
-    for(i=0;i<MSG_DLC(&_msg) && i<8;i++){
-	iowrite8(_msg.data[i],&msg->data[i]);
+	wptr=node->dpm_txbuf.wptr;
+	size=node->dpm_txbuf.size;
+
+	/* ..write them into all of the free units in dpm.. */
+	dpm_write_msgs(node->tx_base,node->tx_stage,wptr,size,room);
+
+	/*.. and publish them with a single write pointer update */
+	buf_advance_wptr(&node->dpm_txbuf,room);
+	done+=room;
     }
 
-    /*.. and increment write pointer */
-    buf_increment_wptr(&node->dpm_txbuf);
+    mutex_unlock(&node->tx_lock);
 
-    ret=sizeof(struct can_msg);
+    if(done)
+	ret=done*sizeof(struct can_msg);
 
-out:
     return ret;
 }
 
 int hcan_open(struct inode *inode, struct file *filp)
 {
     struct hcan_node *node;
+    struct hcan_file *hf;
 
     node = container_of(inode->i_cdev, struct hcan_node, cdev);
 
-    filp->private_data = node;
+    /* The board may still be restarted after probe */
+    if(wait_for_completion_interruptible(&node->board->fw_ready)){
+	return -ERESTARTSYS;
+    }
+
+    hf = kzalloc(sizeof(*hf), GFP_KERNEL);
+    if(!hf){
+	return -ENOMEM;
+    }
+    kref_get(&node->board->ref);
+    hf->node = node;
+    spin_lock_init(&hf->lock);
+    INIT_LIST_HEAD(&hf->results);
+    init_waitqueue_head(&hf->ev_result);
+
+    filp->private_data = hf;
 
     return 0;
 }
@@ -1159,29 +3705,157 @@ int hcan_open(struct inode *inode, struct file *filp)
 unsigned int hcan_poll(struct file *filp, poll_table * wait)
 {
     unsigned int mask = 0;
-    struct hcan_node *node = filp->private_data;
+    struct hcan_file *hf = filp->private_data;
+    struct hcan_node *node = hf->node;
 
     /* Add the read and write wait queues to the polled wait queues */
     poll_wait(filp, &node->ev_rx_ready, wait);
     poll_wait(filp, &node->ev_tx_ready, wait);
+    poll_wait(filp, &hf->ev_result, wait);
 
-    if (buf_not_full(&node->dpm_txbuf)){
+    /* Results of asynchronous commands */
+    if (!list_empty_careful(&hf->results))
+	mask |= POLLPRI;
+
+    if (node->board->removed)
+	return mask | POLLERR | POLLHUP;
+
+    if (node->bypass)
+	return mask | POLLERR;
+
+    if (node->tx_queue.msgs){
+	if (node_tx_pending(node)<node->tx_queue.size)
+	    mask |= POLLOUT | POLLWRNORM;
+	else
+	    board_int_enable(node->board,node->tx_int);
+    } else if (buf_not_full(&node->dpm_txbuf)){
 	mask |= POLLOUT | POLLWRNORM;
     } else {
-	iosetbits16(node->tx_int,&node->board->dpm->int_enable);
+	board_int_enable(node->board,node->tx_int);
     }
 
-    if (buf_not_empty(&node->dpm_rxbuf)){
+    if (node->rx_fifo.msgs){
+	unsigned long flags;
+
+	spin_lock_irqsave(&node->rx_fifo.lock,flags);
+	fifo_sync_tail(&node->rx_fifo);
+	if (FIFO_LEVEL(&node->rx_fifo))
+	    mask |= POLLIN | POLLRDNORM;
+	spin_unlock_irqrestore(&node->rx_fifo.lock,flags);
+    } else if (buf_not_empty(&node->dpm_rxbuf)){
 	mask |= POLLIN | POLLRDNORM;
     } else {
-	iosetbits16(node->rx_int,&node->board->dpm->int_enable);
+	board_int_enable(node->board,node->rx_int);
     }
 
     return mask;
 }
 
+/* The mapping keeps the file open, and through it the node is found */
+static void hcan_vma_open(struct vm_area_struct *vma)
+{
+    struct hcan_fifo *fifo=vma->vm_private_data;
+
+    kref_get(&FILE_NODE(vma->vm_file)->board->ref);
+    atomic_inc(&fifo->mapped);
+}
+
+static void hcan_vma_close(struct vm_area_struct *vma)
+{
+    struct hcan_fifo *fifo=vma->vm_private_data;
+
+    atomic_dec(&fifo->mapped);
+    board_put(FILE_NODE(vma->vm_file)->board);
+}
+
+static const struct vm_operations_struct hcan_vm_ops = {
+    .open = hcan_vma_open,
+    .close = hcan_vma_close,
+};
+
+/* Map the receive or transmit ring of the node into the application. The offset
+ * selects what is mapped (HCAN_MMAP_* in hico_api.h) */
+int hcan_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct hcan_node *node = FILE_NODE(filp);
+    unsigned long len=vma->vm_end-vma->vm_start;
+    struct hcan_fifo *fifo;
+    int ret;
+
+    if(node->board->removed)
+	return -ENODEV;
+
+    /* The status page is read-only and can be mapped in bypass mode too */
+    if(vma->vm_pgoff==HCAN_MMAP_STATUS>>PAGE_SHIFT){
+	if(!node->status_page)
+	    return -ENODEV;
+	if(vma->vm_flags&VM_WRITE)
+	    return -EPERM;
+	if(len>HCAN_STATUS_LEN)
+	    return -EINVAL;
+
+	ret=remap_vmalloc_range(vma,node->status_page,0);
+	if(ret)
+	    return ret;
+
+	vma->vm_flags&=~VM_MAYWRITE;
+	vma->vm_private_data=node->board;
+	vma->vm_ops=&hcan_status_vm_ops;
+	hcan_status_vma_open(vma);
+	return 0;
+    }
+
+    switch(vma->vm_pgoff){
+    case HCAN_MMAP_RX_RING>>PAGE_SHIFT:
+	fifo=&node->rx_fifo;
+	break;
+    case HCAN_MMAP_TX_RING>>PAGE_SHIFT:
+	fifo=&node->tx_queue;
+	break;
+    default:
+	return -EINVAL;
+    }
+
+    if(!fifo->shared)
+	return -ENODEV;
+
+    if(len>PAGE_ALIGN(HCAN_RING_LEN(fifo->size)))
+	return -EINVAL;
+
+    mutex_lock(&node->bypass_lock);
+    if(node->bypass){
+	ret=-EBUSY;
+	goto out;
+    }
+
+    ret=remap_vmalloc_range(vma,fifo->shared,0);
+    if(ret)
+	goto out;
+
+    vma->vm_private_data=fifo;
+    vma->vm_ops=&hcan_vm_ops;
+    hcan_vma_open(vma);
+
+out:
+    mutex_unlock(&node->bypass_lock);
+    return ret;
+}
+
 int hcan_release(struct inode *inode, struct file *filp)
 {
+    struct hcan_file *hf = filp->private_data;
+    struct hcan_node *node = hf->node;
+
+    /* Give the data path back if the application didn't. A removed board
+     * isn't touched anymore */
+    if(node->bypass==filp && !node->board->removed){
+	node_set_bypass(node,filp,0);
+    }
+
+    file_acmd_release(hf);
+    kfree(hf);
+    board_put(node->board);
+
     return 0;
 }
 
@@ -1192,6 +3866,7 @@ struct file_operations hcan_fops = {
     .write = hcan_write,
     .unlocked_ioctl = hcan_ioctl,
     .poll = hcan_poll,
+    .mmap = hcan_mmap,
     .open = hcan_open,
     .release = hcan_release,
 };
@@ -1215,30 +3890,88 @@ struct file_operations hnode_fops = {
 //    .release = hcan_release,
 };
 
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19) 
-static irqreturn_t hcan_interrupt(int irq, void *__host)
-#else
-static irqreturn_t hcan_interrupt(int irq, void *__host, struct pt_regs *regs)
-#endif
+/* Copy the parts of the DPM control area which the interrupt handler needs
+ * into board->snap with burst reads. The end of the area, from
+ * board_status.cmd_ack_cnt on (ack counter, fw state, interrupt registers
+ * and mailbox), is always copied. The queue variables at the start only if
+ * queues is set. The node status in between isn't needed. The copy is in
+ * DPM (little endian) byte order */
+static void dpm_snapshot(struct hcan_board *board, int queues)
+{
+    struct dpm *snap=&board->snap;
+    size_t tail=offsetof(struct dpm,board_status.cmd_ack_cnt);
+
+    if(!queues){
+	memcpy_fromio((uint8_t *)snap+tail,(uint8_t *)board->dpm+tail,
+		sizeof(struct dpm)-tail);
+	return;
+    }
+
+    memcpy_fromio(snap->tx_buffers,board->dpm->tx_buffers,
+	    sizeof(snap->tx_buffers)+sizeof(snap->rx_buffers));
+}
+
+/* Work of the interrupt handler. With polled set, this is called from
+ * the poll_rate timer and looks at all of the nodes and the command
+ * acknowledge regardless of what the mailbox says */
+static irqreturn_t board_service(struct hcan_board *board, int polled)
 {
     int i;
-    struct hcan_board *board=__host;
+    struct dpm *snap=&board->snap;
     uint16_t reason,tmp,fw_state;
+    irqreturn_t ret=IRQ_HANDLED;
+    u64 t0,t;
+
+    t0=ktime_get_ns();
+
+    /* The board counts the interrupts it raises. If the count hasn't moved
+     * the interrupt came from another device on a shared line, which can be
+     * told with a single PCI read. Only trusted while fw2 runs - during
+     * reset everything goes through the full check below.
+     *
+     * A firmware which has just crashed may raise INT_EXCEPION without
+     * counting it. Rejecting that one would lose the crash, and with it the
+     * recovery, for good: nothing else looks at the board until the next
+     * counted interrupt, which a crashed firmware doesn't send. So while
+     * INT_EXCEPION is enabled the mailbox is read as well before the
+     * interrupt is given away. That second read is only done for
+     * interrupts which already look foreign, never for the board's own */
+    if(!polled && board->fw_state==FW2_RUNNING &&
+	    ioread16(&board->dpm->int_count)==board->last_int_count &&
+	    (!(board->int_enable&INT_EXCEPION) ||
+	     !ioread16(&board->dpm->mb_hico2host))){
+	board->irq_rejected++;
+	return IRQ_NONE;
+    }
 
+    dpm_snapshot(board,0);
+    board->last_int_count=le16_to_cpu(snap->int_count);
 
     /* Get the irq reason and clear the cell. The reason can't be trusted
      * 100%, since we can't read and reset the cell atomically (not on all
      * platforms at least), so we always check the tx/rx queue status as well.
      * We use it just for performance. */
-    reason = ioread16(&board->dpm->mb_hico2host);
+    reason = le16_to_cpu(snap->mb_hico2host);
     iowrite16(0,&board->dpm->mb_hico2host);
+    if(polled){
+	reason|=INT_NODES|INT_CMD_ACK;
+    }
 
     /* During reset, the board sends some not wanted interrupts. If FW2 is not
      * running - only command ack interrupts are let through */
-    fw_state=ioread16(&board->dpm->board_status.fw_running);
+    fw_state=le16_to_cpu(snap->board_status.fw_running);
+    if(fw_state!=board->fw_state){
+	board_status_stale(board);
+
+	/* The driver never takes the firmware there by itself */
+	if(board->fw_state==FW2_RUNNING && fw_state==EXCPT_RUNNING && auto_recover){
+	    schedule_work(&board->recover_work);
+	}
+    }
+    board->fw_state=fw_state;
     if(fw_state!=FW2_RUNNING){
 	if(fw_state==FW1_RUNNING || fw_state==EXCPT_RUNNING){
-	    reason&=INT_CMD_ACK;
+	    reason&=INT_CMD_ACK|INT_ERROR|INT_EXCEPION;
 	} else {
 	    reason=0;
 	}
@@ -1261,38 +3994,182 @@ static irqreturn_t hcan_interrupt(int irq, void *__host, struct pt_regs *regs)
     }
     
     if(!reason){
+	board->irq_rejected++;
 	return IRQ_NONE;
     }
+
+    /* A node may have gone bus off */
+    if((reason&INT_ERROR) && fw_state==FW2_RUNNING){
+	mod_delayed_work(system_wq,&board->busoff_work,0);
+    }
+
+    /* Leave the nodes to the interrupt thread and keep their interrupts off
+     * until it's done */
+    if(irq_poll && !polled){
+	if(reason&INT_NODES){
+	    spin_lock(&board->int_lock);
+	    board->poll_mask|=board->int_enable&INT_NODES;
+	    __board_int_update(board,0,INT_NODES);
+	    spin_unlock(&board->int_lock);
+	    ret=IRQ_WAKE_THREAD;
+	}
+	reason&=~INT_NODES;
+    }
+
+    /* Queue variables of all nodes at once */
+    if(reason&INT_NODES){
+	dpm_snapshot(board,1);
+    }
+
     for(i=0;i<NUMBER_OF_CAN_NODES;i++){
 	struct hcan_node *node=&board->node[i];
-	if(node->disabled) continue;
+	if(node->disabled || node->bypass) continue;
 
+	/* The queue states are decided from the snapshot: the firmware owned
+	 * pointer from there, the host owned one from the host copy */
 	if(reason&node->rx_int ){
-	    if(buf_not_empty(&node->dpm_rxbuf)){
+	    int rx_wptr=le16_to_cpu(snap->rx_buffers[i].wptr);
+
+	    if(rx_wptr==node->dpm_rxbuf.rptr){
+		/* Nothing new */
+	    } else if(node->rx_fifo.msgs){
+		/* Rx interrupts stay enabled with the FIFO, unless they are
+		 * coalesced */
+		if(node_drain_rx(node)){
+		    wake_up_interruptible(&node->ev_rx_ready);
+		}
+		if(!polled){
+		    node_rx_coalesce(node);
+		}
+	    } else {
 		wake_up_interruptible(&node->ev_rx_ready);
 
 		/* Disable rx interrupts */
-		ioclrbits16(node->rx_int,&node->board->dpm->int_enable);
+		board_int_disable(node->board,node->rx_int);
 	    }
 	}
 
 	if(reason&node->tx_int){
+	    /* Refill the DPM from the transmit queue first. If something is
+	     * left in the queue, the DPM buffer is full, so Tx interrupts stay
+	     * enabled until both of them are empty */
+	    if(node->tx_queue.msgs){
+		node_fill_tx(node);
+	    }
 	    wake_up_interruptible(&node->ev_tx_ready);
-	    if(buf_is_empty(&node->dpm_txbuf)){
+	    if(le16_to_cpu(snap->tx_buffers[i].rptr)==node->dpm_txbuf.wptr){
 		/* Disable Tx interrupts */
-		ioclrbits16(node->tx_int,&node->board->dpm->int_enable);
+		board_int_disable(node->board,node->tx_int);
 	    }
 	} 
 
     }
 
-    tmp=ioread16(&board->dpm->board_status.cmd_ack_cnt);
+    tmp=le16_to_cpu(snap->board_status.cmd_ack_cnt);
     if(tmp!=board->last_ack_count){
         board->last_ack_count=tmp;
 	board->cmd_ack=1;
 	wake_up(&board->ev_cmd_ack);
     } 
+
+    t=ktime_get_ns()-t0;
+    board->irq_handled++;
+    board->irq_ns_total+=t;
+    if(t>board->irq_ns_max)
+	board->irq_ns_max=t;
 	
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,19) 
+static irqreturn_t hcan_interrupt(int irq, void *__host)
+#else
+static irqreturn_t hcan_interrupt(int irq, void *__host, struct pt_regs *regs)
+#endif
+{
+    return board_service(__host,0);
+}
+
+/* poll_rate timer */
+static enum hrtimer_restart hcan_poll_timer(struct hrtimer *timer)
+{
+    struct hcan_board *board=container_of(timer,struct hcan_board,poll_timer);
+
+    board_service(board,1);
+    hrtimer_forward_now(timer,board->poll_period);
+
+    return HRTIMER_RESTART;
+}
+
+/* Interrupt thread for irq_poll. Moves messages between the DPM queues and
+ * the host FIFO/queue of every node and wakes up the readers and writers.
+ * Polls as long as a pass moves at least irq_poll_budget messages, then
+ * gives the masked interrupts back to the board. Interrupts which aren't
+ * needed anymore (Rx without FIFO once the reader has been woken up, Tx
+ * once the DPM buffer is empty) are left off, as in the handler */
+static irqreturn_t hcan_irq_thread(int irq, void *__host)
+{
+    struct hcan_board *board=__host;
+    unsigned long flags;
+    uint16_t done_mask,coal_seen=0,coal_mask=0;
+    int i,work,n,passes=0;
+
+    do{
+	work=0;
+	done_mask=0;
+	board->poll_passes++;
+
+	for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	    struct hcan_node *node=&board->node[i];
+	    if(node->disabled) continue;
+	    if(node->bypass){
+		done_mask|=node->rx_int|node->tx_int;
+		continue;
+	    }
+
+	    if(node->rx_fifo.msgs){
+		n=node_drain_rx(node);
+		if(n){
+		    wake_up_interruptible(&node->ev_rx_ready);
+		    work+=n;
+
+		    /* The wakeup is one interrupt, however many passes it
+		     * takes, so it is counted and coalesced once */
+		    if(!(coal_seen&node->rx_int)){
+			coal_seen|=node->rx_int;
+			if(node_rx_coalesce(node)){
+			    coal_mask|=node->rx_int;
+			}
+		    }
+		}
+		done_mask|=coal_mask&node->rx_int;
+	    } else if(buf_not_empty(&node->dpm_rxbuf)){
+		wake_up_interruptible(&node->ev_rx_ready);
+		done_mask|=node->rx_int;
+	    }
+
+	    if(node->tx_queue.msgs){
+		n=node_tx_pending(node);
+		work+=n-node_fill_tx(node);
+	    }
+	    wake_up_interruptible(&node->ev_tx_ready);
+	    if(buf_is_empty(&node->dpm_txbuf)){
+		done_mask|=node->tx_int;
+	    }
+	}
+
+	spin_lock_irqsave(&board->int_lock,flags);
+	board->poll_mask&=~done_mask;
+	if(work<irq_poll_budget || ++passes>=IRQ_POLL_PASSES_MAX){
+	    /* Idle enough or long enough - back to interrupts */
+	    __board_int_update(board,board->poll_mask,0);
+	    board->poll_mask=0;
+	}
+	spin_unlock_irqrestore(&board->int_lock,flags);
+
+	cond_resched();
+    } while(work>=irq_poll_budget && passes<IRQ_POLL_PASSES_MAX);
+
     return IRQ_HANDLED;
 }
 
@@ -1326,6 +4203,12 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 	return -EINVAL;
     }
 
+    if(rx_fifo_policy!=RX_FIFO_DROP_NEWEST && rx_fifo_policy!=RX_FIFO_DROP_OLDEST){
+	printk(KERN_ERR "%s: invalid rx_fifo_policy %u\n",
+		__FUNCTION__,rx_fifo_policy);
+	return -EINVAL;
+    }
+
     ret = pci_enable_device(pdev);
     if (ret){
 	printk(KERN_WARNING "%s: Failed to enable device\n",
@@ -1351,6 +4234,7 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 
     memset(board, 0, sizeof(*board));
     board->pdev = pdev;
+    kref_init(&board->ref);
     
     board->number = board_count;
     board_count++;
@@ -1358,6 +4242,13 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
     /* Default timeout for board commands */
     board->cmd_timeout=HZ;
 
+    board->fw1_version=-1;
+    INIT_WORK(&board->fw1_work,board_fw1_work);
+    init_completion(&board->fw_ready);
+
+    INIT_WORK(&board->recover_work,board_recover_work);
+    mutex_init(&board->recover_lock);
+
     init_waitqueue_head(&board->ev_cmd_ack);
 
     /* PCI configuration registers */
@@ -1380,6 +4271,16 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 	    goto err_out_kfree;
     }
 
+    /* See tx_wc about when this really is write-combining */
+    if(tx_wc){
+	board->dpm_wc_base = ioremap_wc(pci_resource_start(pdev, 2),
+			 pci_resource_len(pdev, 2));
+	if (!board->dpm_wc_base) {
+	    printk(KERN_WARNING "%s: could not map DPM write-combining on board %s\n",
+		   __FUNCTION__,pci_name(pdev));
+	}
+    }
+
 
     /* Get EEPROM Revision code. 'Old' MiniPCI cards have revision 0xC (only
      * 8kB DPM window. MiniPCI-4C cards have 0xD (or higher) */
@@ -1416,6 +4317,25 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 
     /* Initialse board mutex */
     sema_init(&board->sem, 1);
+    init_rwsem(&board->restart_sem);
+
+    /* Asynchronous commands and the error statistics refresh */
+    spin_lock_init(&board->acmd_lock);
+    for(i=0;i<HCAN_PRIO_COUNT;i++){
+	INIT_LIST_HEAD(&board->acmd_queue[i]);
+    }
+    init_waitqueue_head(&board->ev_acmd);
+    INIT_WORK(&board->acmd_work,board_acmd_work);
+    INIT_DELAYED_WORK(&board->err_work,board_err_work);
+    INIT_DELAYED_WORK(&board->busoff_work,board_busoff_work);
+
+    seqlock_init(&board->shadow_lock);
+
+    mutex_init(&board->status_lock);
+    hrtimer_init(&board->status_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+    board->status_timer.function=board_status_timer;
+    board->status_period=ns_to_ktime((u64)max_t(unsigned int,status_usecs,
+		STATUS_USECS_MIN)*NSEC_PER_USEC);
 
     /* Create a proc file entry for the board. Use the bus and device numbers
      * for the filename. The must be a more intelligent way to get the bus/dev
@@ -1495,6 +4415,62 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 	} else {
 	    node->dpm_rxbuf.base = (BUF_UNIT *)((uint8_t *)board->dpm_base + ioread16(&node->dpm_rxbuf.vars->base));
 	    node->dpm_txbuf.base = (BUF_UNIT *)((uint8_t *)board->dpm_base + ioread16(&node->dpm_txbuf.vars->base));
+
+	    if(board->dpm_wc_base){
+		node->tx_base = (BUF_UNIT *)(board->dpm_wc_base + ioread16(&node->dpm_txbuf.vars->base));
+	    } else {
+		node->tx_base = node->dpm_txbuf.base;
+	    }
+
+	    buf_init_host(&node->dpm_rxbuf,BUF_HOST_RPTR);
+	    buf_init_host(&node->dpm_txbuf,BUF_HOST_WPTR);
+
+	    node->tx_stage = kmalloc(node->dpm_txbuf.size*sizeof(struct can_msg),
+		    GFP_KERNEL);
+	    if(!node->tx_stage){
+		ret=-ENOMEM;
+		goto err_out_kfree_nodes;
+	    }
+
+	    if(rx_fifo_size && !fw_update){
+		node->rx_fifo.size=roundup_pow_of_two(max_t(unsigned int,rx_fifo_size,FIFO_MIN_SIZE));
+		node->rx_fifo.shared=vmalloc_user(HCAN_RING_LEN(node->rx_fifo.size));
+		if(!node->rx_fifo.shared){
+		    printk(KERN_ERR "%s: could not allocate Rx fifo of %u messages for can%d\n",
+			    __FUNCTION__,node->rx_fifo.size,node->minor);
+		    ret=-ENOMEM;
+		    goto err_out_kfree_nodes;
+		}
+		node->rx_fifo.shared->size=node->rx_fifo.size;
+		node->rx_fifo.msgs=HCAN_RING_MSGS(node->rx_fifo.shared);
+		node->rx_fifo.policy=rx_fifo_policy;
+	    }
+	    spin_lock_init(&node->rx_fifo.lock);
+
+	    if(tx_queue_size && !fw_update){
+		node->tx_queue.size=roundup_pow_of_two(max_t(unsigned int,tx_queue_size,FIFO_MIN_SIZE));
+		node->tx_queue.shared=vmalloc_user(HCAN_RING_LEN(node->tx_queue.size));
+		if(!node->tx_queue.shared){
+		    printk(KERN_ERR "%s: could not allocate Tx queue of %u messages for can%d\n",
+			    __FUNCTION__,node->tx_queue.size,node->minor);
+		    ret=-ENOMEM;
+		    goto err_out_kfree_nodes;
+		}
+		node->tx_queue.shared->size=node->tx_queue.size;
+		node->tx_queue.msgs=HCAN_RING_MSGS(node->tx_queue.shared);
+	    }
+	    spin_lock_init(&node->tx_queue.lock);
+
+	    node->status_page=vmalloc_user(HCAN_STATUS_LEN);
+	    if(!node->status_page){
+		ret=-ENOMEM;
+		goto err_out_kfree_nodes;
+	    }
+
+	    hrtimer_init(&node->coal_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+	    node->coal_timer.function=node_coal_timer;
+	    node->coal.max_usecs=min_t(unsigned int,rx_coalesce_usecs,USEC_PER_SEC);
+	    node->coal.max_frames=rx_coalesce_frames;
 	}
 
 
@@ -1520,6 +4496,21 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 	
 	init_waitqueue_head(&node->ev_tx_ready);
 	init_waitqueue_head(&node->ev_rx_ready);
+	mutex_init(&node->rx_lock);
+	mutex_init(&node->tx_lock);
+	mutex_init(&node->err_lock);
+	mutex_init(&node->cfg_lock);
+	mutex_init(&node->bypass_lock);
+	node_cfg_init(&node->cfg);
+
+	node->busoff.policy=busoff_recovery;
+	node->busoff.delay_ms=busoff_delay_ms;
+	node->busoff.max_delay_ms=busoff_max_delay_ms;
+	if(!busoff_settings_valid(&node->busoff)){
+	    printk(KERN_WARNING "%s: invalid bus off recovery settings, can%d starts without\n",
+		    __FUNCTION__,node->minor);
+	    node->busoff.policy=BUSOFF_RECOVER_OFF;
+	}
 
 	cdev_init(&node->cdev, &hcan_fops);
 	node->cdev.owner = THIS_MODULE;
@@ -1553,8 +4544,24 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 
     pci_set_drvdata(pdev, board);
 
+    spin_lock_init(&board->int_lock);
+    board->int_enable=ioread16(&board->dpm->int_enable);
+
+    if(poll_rate){
+	/* No interrupt line - the timer is started below */
+	hrtimer_init(&board->poll_timer,CLOCK_MONOTONIC,HRTIMER_MODE_REL);
+	board->poll_timer.function=hcan_poll_timer;
+	board->poll_period=ns_to_ktime(NSEC_PER_SEC/
+		min_t(unsigned int,poll_rate,POLL_RATE_MAX));
+	ret=0;
+    } else
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,24)
-    ret = request_irq(pdev->irq, hcan_interrupt, IRQF_SHARED, DRV_NAME, board);
+    if(irq_poll){
+	ret = request_threaded_irq(pdev->irq, hcan_interrupt, hcan_irq_thread,
+		IRQF_SHARED, DRV_NAME, board);
+    } else {
+	ret = request_irq(pdev->irq, hcan_interrupt, IRQF_SHARED, DRV_NAME, board);
+    }
 #else
     ret = request_irq(pdev->irq, hcan_interrupt, SA_SHIRQ, DRV_NAME, board);
 #endif
@@ -1564,21 +4571,32 @@ static int hcan_pci_probe (struct pci_dev *pdev, const struct pci_device_id *pci
 	    goto err_out_kfree_nodes;
     }
 
-    enable_pci_interrupts(board);
+    if(poll_rate){
+	disable_pci_interrupts(board);
+	hrtimer_start(&board->poll_timer,board->poll_period,HRTIMER_MODE_REL);
+    } else {
+	enable_pci_interrupts(board);
+    }
 
     /* Enable command ackowledge interrupts */
-    iosetbits16(INT_CMD_ACK, &board->dpm->int_enable);
+    board_int_enable(board,INT_CMD_ACK);
 
     printk(KERN_INFO "%s: board %s initialized.\n",
 	       __FUNCTION__, pci_name(pdev));
     
-    if(!fw_update)
-        get_fw1_version(board);
-    
+    board->fw_state=ioread16(&board->dpm->board_status.fw_running);
+    board->last_int_count=~ioread16(&board->dpm->int_count);
+
     board->last_ack_count=ioread16(&board->dpm->board_status.cmd_ack_cnt);
 
-    /* Enable command ackowledge interrupts */
-    iosetbits16(INT_CMD_ACK, &board->dpm->int_enable);
+    /* Probe returns right away and the next board is probed while this one
+     * is restarted. The background work is started after the restart */
+    if(!fw_update && fw1_probe){
+	queue_work(system_unbound_wq,&board->fw1_work);
+    } else {
+	board_start(board);
+	complete_all(&board->fw_ready);
+    }
 
     return 0;
 
@@ -1596,8 +4614,13 @@ err_out_kfree_nodes:
         remove_proc_entry(node->proc_name,board->proc_dir);
 	    node->proc_file=NULL;
 	}
+	kfree(node->tx_stage);
+	vfree(node->rx_fifo.shared);
+	vfree(node->tx_queue.shared);
+	vfree(node->status_page);
     }
 
+    if(board->dpm_wc_base) iounmap(board->dpm_wc_base);
     if(board->dpm_base) iounmap(board->dpm_base);
     if(board->cfg_base) iounmap(board->cfg_base);
 
@@ -1623,10 +4646,42 @@ static void hcan_pci_remove (struct pci_dev *pdev)
     int i;
     struct hcan_board *board = pci_get_drvdata(pdev);
 
-    disable_pci_interrupts(board);
-    
-    free_irq(pdev->irq, board);
+    /* The files which are still open leave the board alone from now on */
+    board->removed=1;
 
+    /* Let the fw1 version check finish, or drop it if it hasn't started,
+     * and don't keep anybody waiting in open() */
+    cancel_work_sync(&board->fw1_work);
+    complete_all(&board->fw_ready);
+
+    /* Stop the refresh before the commands stop getting acknowledged */
+    cancel_delayed_work_sync(&board->err_work);
+    cancel_work_sync(&board->acmd_work);
+    hrtimer_cancel(&board->status_timer);
+
+    if(poll_rate){
+	hrtimer_cancel(&board->poll_timer);
+    } else {
+	disable_pci_interrupts(board);
+	free_irq(pdev->irq, board);
+    }
+
+    /* Commands in progress are waited for, later ones find the firmware
+     * not running. The interrupt handler doesn't set fw_state anymore */
+    down_write(&board->restart_sem);
+    board->fw_state=0;
+    up_write(&board->restart_sem);
+
+    /* Nothing can start a recovery anymore */
+    cancel_work_sync(&board->recover_work);
+    cancel_delayed_work_sync(&board->busoff_work);
+    kfree(board->excpt_text);
+
+    for(i=0;i<NUMBER_OF_CAN_NODES;i++){
+	if(!board->node[i].disabled && board->node[i].rx_fifo.msgs){
+	    hrtimer_cancel(&board->node[i].coal_timer);
+	}
+    }
 
     for(i=0;i<NUMBER_OF_CAN_NODES;i++){
 	struct hcan_node *node=&board->node[i];
@@ -1635,10 +4690,24 @@ static void hcan_pci_remove (struct pci_dev *pdev)
 	if(node->cdev_added){
 	    cdev_del(&node->cdev);
 	}
+
+	/* Readers and writers see removed and leave. The ones inside the
+	 * data path are done once their lock is free */
+	wake_up_interruptible(&node->ev_rx_ready);
+	wake_up_interruptible(&node->ev_tx_ready);
+	mutex_lock(&node->rx_lock);
+	mutex_unlock(&node->rx_lock);
+	mutex_lock(&node->tx_lock);
+	mutex_unlock(&node->tx_lock);
+
 	if(node->proc_file){
         remove_proc_entry(node->proc_name,board->proc_dir);
 	    node->proc_file=NULL;
 	}
+	kfree(node->tx_stage);
+	vfree(node->rx_fifo.shared);
+	vfree(node->tx_queue.shared);
+	vfree(node->status_page);
     }
 
     if(board->proc_file){
@@ -1646,11 +4715,13 @@ static void hcan_pci_remove (struct pci_dev *pdev)
 	board->proc_file=NULL;
     }
 
+    if(board->dpm_wc_base) iounmap(board->dpm_wc_base);
     if(board->dpm_base) iounmap(board->dpm_base);
     if(board->cfg_base) iounmap(board->cfg_base);
 
 
-    kfree(board);
+    /* Mappings of the nodes may still be there */
+    board_put(board);
     board_count--;
     pci_release_regions(pdev);
     pci_disable_device(pdev);
@@ -1679,6 +4750,13 @@ static int __init hcan_init(void)
     dev_t devNo;
     int ret;
 
+    /* With a budget of 0 the interrupt thread would never stop polling */
+    if(irq_poll_budget<1){
+	printk(KERN_WARNING "%s: irq_poll_budget must be at least 1, using 1\n",
+		__FUNCTION__);
+	irq_poll_budget=1;
+    }
+
     if(major){
 	devNo=MKDEV(major,FIRST_MINOR);
 	ret=register_chrdev_region(devNo,MINOR_COUNT,DRV_NAME);
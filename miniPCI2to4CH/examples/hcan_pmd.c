@@ -0,0 +1,186 @@
+/*EM_LICENSE*/
+/*
+ * $Id$
+ *
+ * hcan_pmd.c: Poll mode access to the DPM message queues, see hcan_pmd.h
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include "hcan_pmd.h"
+
+/* The queue variables and the messages are used in the byte order of the
+ * DPM, see hcan_pmd.h */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "hcan_pmd works on little endian hosts only"
+#endif
+
+/* The queue functions of the driver. Outside of the kernel they access the
+ * queue variables directly and write them with DPM_WRITE. Everything done
+ * with the messages has to be finished before the other side sees the
+ * pointer move */
+#define DPM_WRITE(addr,val) do{ __sync_synchronize(); *(addr)=(val); }while(0)
+#define KERN_ERR "hcan_pmd: "
+#define printk(fmt...) fprintf(stderr,fmt)
+#include "../driver/dpm.c"
+
+int hcan_pmd_open(struct hcan_pmd *pmd, const char *dev)
+{
+    char pci_name[HCAN_PCI_NAME_LEN];
+    char path[128];
+    struct stat st;
+    size_t dpm_size;
+    uint32_t number;
+    int res,on=1,saved;
+
+    memset(pmd,0,sizeof(*pmd));
+
+    pmd->fd=open(dev,O_RDWR);
+    if(pmd->fd<0){
+	return -1;
+    }
+
+    if(ioctl(pmd->fd,IOC_GET_NODE_NUMBER,&number)){
+	goto err_close;
+    }
+    pmd->node=number;
+
+    /* The DPM is the second memory region of the board */
+    if(ioctl(pmd->fd,IOC_GET_PCI_NAME,pci_name)){
+	goto err_close;
+    }
+    snprintf(path,sizeof(path),"/sys/bus/pci/devices/%s/resource2",pci_name);
+
+    res=open(path,O_RDWR|O_SYNC);
+    if(res<0){
+	goto err_close;
+    }
+    if(fstat(res,&st)){
+	close(res);
+	goto err_close;
+    }
+    pmd->map_len=st.st_size;
+    pmd->dpm_base=mmap(NULL,pmd->map_len,PROT_READ|PROT_WRITE,MAP_SHARED,res,0);
+    close(res);
+    if(pmd->dpm_base==MAP_FAILED){
+	goto err_close;
+    }
+
+    /* Find the control area the same way as the driver. The DPM is
+     * mirrored in the window, so the hardware id can be read from the end
+     * of it before the size is known */
+    pmd->dpm=SET_DPM_PTR(pmd->dpm_base,pmd->map_len);
+    switch(pmd->dpm->board_status.hw_id){
+	case HW_HICOCAN_MPCI:
+	case HW_HICOCAN_PCI104:
+	case HW_HICOCAN_UNKNOWN:
+	    dpm_size=8*1024;
+	    break;
+	case HW_HICOCAN_MPCI_4C:
+	    dpm_size=16*1024;
+	    break;
+	default:
+	    dpm_size=pmd->map_len;
+	    break;
+    }
+    pmd->dpm=SET_DPM_PTR(pmd->dpm_base,dpm_size);
+
+    /* From now on the driver keeps away from the queues */
+    if(ioctl(pmd->fd,IOC_SET_BYPASS,&on)){
+	goto err_unmap;
+    }
+
+    pmd->rx.vars=&pmd->dpm->rx_buffers[pmd->node];
+    pmd->tx.vars=&pmd->dpm->tx_buffers[pmd->node];
+    pmd->rx.base=(BUF_UNIT *)((uint8_t *)pmd->dpm_base + pmd->rx.vars->base);
+    pmd->tx.base=(BUF_UNIT *)((uint8_t *)pmd->dpm_base + pmd->tx.vars->base);
+
+    return 0;
+
+err_unmap:
+    saved=errno;
+    munmap(pmd->dpm_base,pmd->map_len);
+    errno=saved;
+err_close:
+    saved=errno;
+    close(pmd->fd);
+    errno=saved;
+    return -1;
+}
+
+void hcan_pmd_close(struct hcan_pmd *pmd)
+{
+    int off=0;
+
+    ioctl(pmd->fd,IOC_SET_BYPASS,&off);
+    munmap(pmd->dpm_base,pmd->map_len);
+    close(pmd->fd);
+}
+
+int hcan_pmd_recv(struct hcan_pmd *pmd, struct can_msg *msgs, int max)
+{
+    struct buffer *buf=&pmd->rx;
+    int i,n,run,rptr,size,dlc;
+
+    n=buf_message_cnt(buf);
+    if(n>max) n=max;
+    if(n<=0) return 0;
+
+    /* Read the messages only after the write pointer */
+    __sync_synchronize();
+
+    rptr=buf->vars->rptr;
+    size=buf->vars->size;
+
+    /* The messages may wrap around the end of the queue */
+    run=size-rptr;
+    if(run>n) run=n;
+    memcpy(msgs,buf->base+rptr,run*sizeof(BUF_UNIT));
+    if(n>run){
+	memcpy(msgs+run,buf->base,(n-run)*sizeof(BUF_UNIT));
+    }
+
+    buf_advance_rptr(buf,n);
+
+    /* Don't pass stale DPM contents behind the data, as the driver */
+    for(i=0;i<n;i++){
+	dlc=MSG_DLC(&msgs[i]);
+	if(dlc<8){
+	    memset(&msgs[i].data[dlc],0,8-dlc);
+	}
+    }
+
+    return n;
+}
+
+int hcan_pmd_send(struct hcan_pmd *pmd, const struct can_msg *msgs, int n)
+{
+    struct buffer *buf=&pmd->tx;
+    int room,run,wptr,size;
+
+    room=buf_free_cnt(buf);
+    if(n>room) n=room;
+    if(n<=0) return 0;
+
+    wptr=buf->vars->wptr;
+    size=buf->vars->size;
+
+    run=size-wptr;
+    if(run>n) run=n;
+    memcpy(buf->base+wptr,msgs,run*sizeof(BUF_UNIT));
+    if(n>run){
+	memcpy(buf->base,msgs+run,(n-run)*sizeof(BUF_UNIT));
+    }
+
+    /* All of the messages are published with one pointer update */
+    buf_advance_wptr(buf,n);
+
+    return n;
+}
@@ -0,0 +1,64 @@
+/*EM_LICENSE*/
+/*
+ * $Id$
+ *
+ * hcan_pmd.h: Poll mode access to the message queues of a CAN node. The DPM
+ * of the board is mapped into the application through the PCI resource file
+ * in sysfs and the queues are read and written directly, with the queue
+ * functions of the driver (driver/dpm.c). There are no system calls and no
+ * interrupts on the data path, so the caller is expected to poll from a
+ * dedicated CPU.
+ *
+ * The driver stays loaded and is used for everything else: the node is
+ * opened as usual, started and configured with the ioctl calls of
+ * hico_api.h, and hcan_pmd_open() detaches only its message queues with
+ * IOC_SET_BYPASS. Mapping the resource file needs root privileges.
+ *
+ * The DPM is little endian and the queue variables and messages are used as
+ * they are, so this works on little endian hosts only; hcan_pmd.c doesn't
+ * build on others. Data bytes beyond the DLC of a received message are
+ * cleared, as read() does.
+ */
+#ifndef _HCAN_PMD_H
+#define _HCAN_PMD_H
+
+#include <stddef.h>
+#include "hico_api.h"
+
+#define __ALLOW_DPM_H
+#include "../driver/dpm.h"
+
+struct hcan_pmd{
+    /* The CAN device, e.g. /dev/can0. Closing it gives the queues back to
+     * the driver */
+    int fd;
+
+    /* Number of the node on the board */
+    int node;
+
+    /* DPM mapping */
+    void *dpm_base;
+    size_t map_len;
+    struct dpm *dpm;
+
+    /* Message queues of the node in the DPM */
+    struct buffer rx;
+    struct buffer tx;
+};
+
+/* Open the CAN device, detach its queues from the driver and map them.
+ * Returns 0 or -1 with errno set */
+int hcan_pmd_open(struct hcan_pmd *pmd, const char *dev);
+
+/* Give the queues back to the driver and close the device */
+void hcan_pmd_close(struct hcan_pmd *pmd);
+
+/* Take up to max received messages out of the Rx queue. Returns the number
+ * of messages, 0 if the queue is empty. Never blocks */
+int hcan_pmd_recv(struct hcan_pmd *pmd, struct can_msg *msgs, int max);
+
+/* Put up to n messages into the Tx queue. Returns the number of messages
+ * which fit, 0 if the queue is full. Never blocks */
+int hcan_pmd_send(struct hcan_pmd *pmd, const struct can_msg *msgs, int n);
+
+#endif
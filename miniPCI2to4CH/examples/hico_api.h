@@ -291,6 +291,323 @@ struct err_stat{
 /* This returns the onboard processors bootloader FW revsision number.*/
 
 
+/**************************************************************************/
+#define IOC_SET_RX_FIFO_POLICY                 _IOW (IOC_MAGIC, 110, uint32_t)
+/**************************************************************************/
+/* Linux driver loaded with rx_fifo_size > 0: received messages are moved
+ * into a host memory FIFO as soon as they arrive. This sets what happens
+ * when the FIFO is full. Returns ENODEV if the node has no FIFO */
+
+/* Keep the messages in the FIFO and throw away the ones that arrive */
+#define RX_FIFO_DROP_NEWEST 0
+/* Make room for the arriving messages by throwing away the oldest ones */
+#define RX_FIFO_DROP_OLDEST 1
+
+/**************************************************************************/
+#define IOC_GET_RX_FIFO_STAT       _IOR (IOC_MAGIC, 111, struct rx_fifo_stat)
+/**************************************************************************/
+/* Fill level and drop counter of the host memory receive FIFO. Returns
+ * ENODEV if the node has no FIFO */
+struct rx_fifo_stat{
+    uint32_t size;       /* FIFO size in messages */
+    uint32_t level;      /* messages currently in the FIFO */
+    uint32_t max_level;  /* highest level since the driver was loaded */
+    uint32_t policy;     /* RX_FIFO_DROP_* */
+    uint64_t dropped;    /* number of messages thrown away */
+};
+
+/**************************************************************************/
+/* mmap() of the receive FIFO                                             */
+/**************************************************************************/
+/* When there's a receive FIFO, an application can mmap() it from the CAN
+ * device at offset HCAN_MMAP_RX_RING and take the messages directly from it
+ * without read() calls. The mapped area starts with struct hcan_ring; the
+ * messages follow at offset HCAN_RING_MSGS_OFFSET. Map HCAN_RING_LEN(size)
+ * bytes, where size is from IOC_GET_RX_FIFO_STAT. The driver moves head when
+ * it adds messages, the application moves tail after it has used them:
+ *
+ *   while(ring->tail != ring->head){  (read head with acquire semantics)
+ *       use(HCAN_RING_MSG(ring,ring->tail));
+ *       ring->tail++;                  (store with release semantics)
+ *   }
+ *
+ * poll() reports POLLIN when there are messages in the ring. While the ring
+ * is mapped, the FIFO always drops the newest messages when it is full */
+#define HCAN_MMAP_RX_RING 0x0000000
+
+struct hcan_ring{
+    uint32_t size;               /* number of messages (a power of two) */
+    volatile uint32_t head;      /* free running, moved by the producer */
+    volatile uint32_t tail;      /* free running, moved by the consumer */
+    uint32_t _reserved;
+    volatile uint64_t dropped;   /* messages dropped because of overflow */
+};
+#define HCAN_RING_MSGS_OFFSET 4096
+#define HCAN_RING_LEN(size) (HCAN_RING_MSGS_OFFSET+(size)*sizeof(struct can_msg))
+#define HCAN_RING_MSGS(ring) \
+    ((struct can_msg *)((uint8_t *)(ring)+HCAN_RING_MSGS_OFFSET))
+#define HCAN_RING_MSG(ring,i) (&HCAN_RING_MSGS(ring)[(i)&((ring)->size-1)])
+
+/**************************************************************************/
+#define IOC_TX_QUEUE_DEPTH                     _IOR (IOC_MAGIC, 115, uint32_t)
+/**************************************************************************/
+/* Linux driver loaded with tx_queue_size > 0: write() puts the messages
+ * into a host memory queue which is moved into the boards transmit buffer
+ * as it gets room. This returns the number of messages waiting in the
+ * queue. The three IOC_TX_QUEUE_* calls return ENODEV if there's no queue */
+
+/**************************************************************************/
+#define IOC_TX_QUEUE_FLUSH                            _IO (IOC_MAGIC, 116)
+/**************************************************************************/
+/* Wait until all of the queued messages have been sent */
+
+/**************************************************************************/
+#define IOC_TX_QUEUE_ABORT                     _IOR (IOC_MAGIC, 117, uint32_t)
+/**************************************************************************/
+/* Throw away the messages which are still in the queue. Returns how many
+ * there were. Messages already in the boards transmit buffer are sent */
+
+/**************************************************************************/
+#define IOC_GET_TX_QUEUE_SIZE                  _IOR (IOC_MAGIC, 118, uint32_t)
+/**************************************************************************/
+/* Size of the transmit queue in messages */
+
+/**************************************************************************/
+#define IOC_TX_RING_KICK                              _IO (IOC_MAGIC, 119)
+/**************************************************************************/
+/* Doorbell for the mmap()ed transmit queue. The queue can be mapped at
+ * offset HCAN_MMAP_TX_RING in the same way as the receive FIFO (see struct
+ * hcan_ring above), with the roles swapped: the application writes messages
+ * at head and moves it, the driver moves tail when the messages have been
+ * taken into the boards transmit buffer:
+ *
+ *   while(n-- && ring->head - ring->tail < ring->size){  (acquire tail)
+ *       *HCAN_RING_MSG(ring,ring->head) = msg;
+ *       ring->head++;                                   (release store)
+ *   }
+ *   ioctl(fd,IOC_TX_RING_KICK);
+ *
+ * The kick moves the new messages into the board right away. Messages added
+ * while the board is still sending earlier ones are also picked up on the
+ * next Tx interrupt, so the kick can be left out then. poll() reports
+ * POLLOUT while there is room in the ring. write() returns EBUSY as long as
+ * the transmit queue is mapped */
+#define HCAN_MMAP_TX_RING 0x1000000
+
+/**************************************************************************/
+#define IOC_SET_BYPASS                         _IOW (IOC_MAGIC, 120, uint32_t)
+/**************************************************************************/
+/* 1 hands the DPM message queues of the node over to the application, 0
+ * gives them back to the driver. In between the application reads and
+ * writes the queues itself through the PCI resource of the board (see
+ * examples/hcan_pmd.h), and the driver doesn't touch them: the Rx and Tx
+ * interrupts of the node are disabled and read(), write() and mmap() return
+ * EBUSY. Messages in the host FIFO or queue are thrown away. Commands (mode,
+ * bitrate, filters, status) keep working through the driver. The queues are
+ * given back when the file is closed. Returns EBUSY if another file has
+ * the node or if the host FIFO or queue is mapped */
+
+/**************************************************************************/
+#define IOC_GET_PCI_NAME      _IOR (IOC_MAGIC, 121, char[HCAN_PCI_NAME_LEN])
+/**************************************************************************/
+/* PCI address of the board (e.g. "0000:03:00.0"), which names its directory
+ * under /sys/bus/pci/devices */
+#define HCAN_PCI_NAME_LEN 32
+
+/**************************************************************************/
+#define IOC_SET_RX_COALESCE        _IOW (IOC_MAGIC, 122, struct rx_coalesce)
+#define IOC_GET_RX_COALESCE        _IOR (IOC_MAGIC, 123, struct rx_coalesce)
+/**************************************************************************/
+/* Rx interrupt coalescing for nodes with a receive FIFO (ENODEV
+ * otherwise). With max_usecs > 0, the Rx interrupt is masked for max_usecs
+ * after each Rx interrupt and the messages which arrive meanwhile are
+ * picked up by a timer. If at least max_frames (> 0) messages came in
+ * during a period, the interrupt stays masked for another one. max_usecs
+ * has to be small enough for the boards buffers to hold what arrives in
+ * that time. The counters are ignored by IOC_SET_RX_COALESCE. The driver
+ * module parameters rx_coalesce_usecs and rx_coalesce_frames give the
+ * settings the nodes start with */
+struct rx_coalesce{
+    uint32_t max_usecs;
+    uint32_t max_frames;
+    uint64_t interrupts;       /* Rx interrupts serviced */
+    uint64_t timer_polls;      /* timer expiries */
+    uint64_t frames_polled;    /* messages picked up by the timer */
+    uint64_t masked_ns_total;  /* time the Rx interrupt was masked */
+    uint64_t masked_ns_max;    /* longest time it was masked at once */
+};
+
+#ifndef __QNX__
+/**************************************************************************/
+#define IOC_GET_ERR_STAT_CACHED _IOWR (IOC_MAGIC, 124, struct err_stat_snapshot)
+/**************************************************************************/
+/* Same table as IOC_GET_ERR_STAT, from a copy kept by the driver. The
+ * firmware hands out the table one entry per command, so reading it takes
+ * 63 round trips to the board. If the copy is at most max_age_ms old, it is
+ * returned without asking the board. Otherwise it is read again first, and
+ * callers which come in meanwhile wait for that and get the same result.
+ * age_ms is the age of the returned table. With the driver module parameter
+ * err_stat_refresh (ms), the tables are read in the background and a
+ * max_age_ms larger than that never waits for the board.
+ * IOC_GET_ERR_STAT always reads the table and updates the copy.
+ * IOC_CLEAR_ERR_STAT and IOC_RESET_BOARD discard it */
+struct err_stat_snapshot{
+    uint32_t max_age_ms;       /* set by the caller */
+    uint32_t age_ms;
+    uint64_t refreshes;        /* times the driver has read the table */
+    struct err_stat stat;
+};
+
+/**************************************************************************/
+#define IOC_CMD_SUBMIT               _IOW (IOC_MAGIC, 125, struct hcan_cmd)
+#define IOC_CMD_RESULT        _IOR (IOC_MAGIC, 126, struct hcan_cmd_result)
+#define IOC_CMD_EVENTFD                        _IOW (IOC_MAGIC, 127, int32_t)
+/**************************************************************************/
+/* Asynchronous commands. IOC_CMD_SUBMIT queues one of the ioctl calls
+ * IOC_START, IOC_START_PASSIVE, IOC_START_BAUDSCAN, IOC_STOP,
+ * IOC_SET_BITRATE, IOC_SET_SJW_INCREMENT, IOC_SET_FILTER,
+ * IOC_CLEAR_FILTERS, IOC_RESET_TIMESTAMP, IOC_GET_ERR_STAT or
+ * IOC_CLEAR_ERR_STAT (see struct hcan_cmd) and returns right away. The
+ * commands of all the nodes of a board are carried out one at a time,
+ * those with a higher priority first. IOC_GET_ERR_STAT is read entry by
+ * entry, and a more urgent command gets in between two entries.
+ *
+ * When a command is done, its result is queued on the file descriptor it
+ * was submitted on. poll() then reports POLLPRI and IOC_CMD_RESULT takes
+ * the oldest result (EAGAIN if there is none yet). IOC_CMD_EVENTFD makes
+ * the driver also signal an eventfd for each result (-1 to stop that). At
+ * most HCAN_CMD_MAX commands per file descriptor may be queued or have
+ * uncollected results; IOC_CMD_SUBMIT returns EAGAIN beyond that. Commands
+ * which are still queued when the file descriptor is closed are dropped */
+#define HCAN_CMD_MAX 64
+
+#define HCAN_PRIO_HIGH   0
+#define HCAN_PRIO_NORMAL 1
+#define HCAN_PRIO_LOW    2
+#define HCAN_PRIO_COUNT  3
+#endif
+
+/**************************************************************************/
+#define IOC_GET_NODE_STATUS       _IOR (IOC_MAGIC, 128, struct node_status)
+/**************************************************************************/
+/* Everything a status monitor usually asks for, with one call. The status
+ * areas of the node and the board are copied from the DPM at once, and
+ * the first fields hold the same values as the single ioctl calls named
+ * next to them would return. The raw copies can be looked at with struct
+ * can_status and struct board_status of driver/dpm.h (little endian).
+ * Ring fields are 0 if the driver has no receive FIFO or transmit queue
+ * for the node. version is NODE_STATUS_VERSION. New fields are only added
+ * at the end, and since the size of the struct is part of the request
+ * code, a changed layout never goes unnoticed */
+#define NODE_STATUS_VERSION 2
+struct node_status{
+    uint32_t version;
+    uint32_t mode;             /* IOC_GET_MODE */
+    uint32_t can_status;       /* IOC_GET_CAN_STATUS */
+    uint32_t board_status;     /* IOC_GET_BOARD_STATUS */
+    uint32_t iopin;            /* IOC_GET_IOPIN_STATUS */
+    uint32_t bitrate;          /* IOC_GET_BITRATE */
+    uint32_t can_type;         /* IOC_GET_CAN_TYPE */
+    uint32_t msgs_in_rxbuf;    /* IOC_MSGS_IN_RXBUF */
+    uint32_t msgs_in_txbuf;    /* IOC_MSGS_IN_TXBUF */
+
+    /* Receive FIFO (see IOC_GET_RX_FIFO_STAT) and transmit queue */
+    uint32_t rx_fifo_level;
+    uint32_t rx_fifo_max_level;
+    uint32_t tx_queue_level;
+    uint64_t rx_fifo_dropped;
+
+    /* Interrupts of the board which the driver has handled and the shared
+     * ones it has found not to be its own */
+    uint64_t irq_handled;
+    uint64_t irq_rejected;
+
+    /* Raw copies of the DPM status areas */
+    uint8_t dpm_can_status[48];
+    uint8_t dpm_board_status[36];
+
+    /* Number of times the driver has restarted the board after a firmware
+     * exception and set up the nodes again (version 2) */
+    uint32_t recoveries;
+};
+
+/**************************************************************************/
+/* mmap() of the status page                                              */
+/**************************************************************************/
+/* Every CAN device offers a read-only page at offset HCAN_MMAP_STATUS
+ * (map HCAN_STATUS_LEN bytes without PROT_WRITE). While it is mapped, the
+ * driver updates it every status_usecs microseconds (driver module
+ * parameter), so the status of the node can be checked without system
+ * calls or PCI accesses. status is filled in as by IOC_GET_NODE_STATUS.
+ * seq is odd while the driver is writing, so a consistent copy is taken
+ * like this:
+ *
+ *   do{
+ *       while((s = page->seq) & 1);    (load with acquire semantics)
+ *       copy = *page;
+ *   }while(page->seq != s);            (after an acquire fence)
+ */
+#define HCAN_MMAP_STATUS 0x2000000
+#define HCAN_STATUS_LEN 4096
+
+struct hcan_status_page{
+    volatile uint32_t seq;
+    uint32_t _reserved;
+    uint64_t stamp_ns;         /* CLOCK_MONOTONIC time of the update */
+
+    /* Messages received, sent and filtered out by the board. The 16 bit
+     * counters of the firmware are extended to 64 bits by the driver and
+     * go on counting over a board reset */
+    uint64_t received;
+    uint64_t sent;
+    uint64_t filtered;
+
+    struct node_status status;
+};
+
+/**************************************************************************/
+#define IOC_SET_BUSOFF_RECOVERY  _IOW (IOC_MAGIC, 129, struct busoff_recovery)
+#define IOC_GET_BUSOFF_RECOVERY  _IOR (IOC_MAGIC, 130, struct busoff_recovery)
+/**************************************************************************/
+/* What the driver does when the node goes bus off (CS_ERROR_BUS_OFF) while
+ * it is started in active or passive mode:
+ *
+ * BUSOFF_RECOVER_OFF: nothing, the application has to restart the node
+ * BUSOFF_RECOVER_IMMEDIATE: the node is restarted in its mode right away
+ * BUSOFF_RECOVER_BACKOFF: the node is restarted after delay_ms. If it goes
+ *     bus off again within max_delay_ms of coming back, the delay is
+ *     doubled, up to max_delay_ms
+ *
+ * The driver notices the bus off within 10 ms. The recovery time is from
+ * then until the node is back on the bus, whether the driver or the
+ * application brought it back. The counters are ignored by
+ * IOC_SET_BUSOFF_RECOVERY. The driver module parameters busoff_recovery,
+ * busoff_delay_ms and busoff_max_delay_ms give the settings the nodes
+ * start with */
+#define BUSOFF_RECOVER_OFF       0
+#define BUSOFF_RECOVER_IMMEDIATE 1
+#define BUSOFF_RECOVER_BACKOFF   2
+
+struct busoff_recovery{
+    uint32_t policy;
+    uint32_t delay_ms;
+    uint32_t max_delay_ms;
+    uint32_t _reserved;
+    uint64_t bus_offs;          /* times the node went bus off */
+    uint64_t restarts;          /* restarts done by the driver */
+    uint64_t recoveries;        /* times the node came back */
+    uint64_t recovery_us_total; /* recovery time of all of them */
+    uint64_t recovery_us_max;   /* longest recovery time */
+};
+
+/**************************************************************************/
+#define IOC_GET_NODE_NUMBER                   _IOR (IOC_MAGIC, 131, uint32_t)
+/**************************************************************************/
+/* Number of the node on its board, counted from 0. It is the index of the
+ * message queues and the status area of the node in the DPM, see
+ * IOC_SET_BYPASS */
+
+
 #if 0
 /**************************************************************************/
 #define IOC_SET_MODE                          _IOW (IOC_MAGIC, 65, uint32_t)
@@ -302,7 +619,14 @@ struct err_stat{
 /* structure of a CAN  messages                                            */
 /**************************************************************************/
 /* This structure is used for sending and receiving messages. Not all fields
- * have a meaning when sending (e.g. timestamp) */
+ * have a meaning when sending (e.g. timestamp)
+ *
+ * read() accepts a buffer for any number of messages (count has to be a
+ * multiple of sizeof(struct can_msg)). It blocks until at least one message
+ * is available and then returns all the messages that fit into the buffer.
+ * write() likewise takes an array of messages. A blocking write returns when
+ * all of them are in the transmit buffer, a non-blocking one returns the
+ * number of bytes of the messages which fit in (or EAGAIN if none did) */
 
 #define MSG_DLC(msg)  (((msg)->fi&0xf)>>0)
 #define MSG_RTR(msg)  (((msg)->fi&(1<<4))>>4)
@@ -382,6 +706,29 @@ struct can_filter{
 #define FTYPE_AMASK 1
 #define FTYPE_RANGE 2
 
+#ifndef __QNX__
+/* Command for IOC_CMD_SUBMIT. ioctl is the ioctl request code and arg takes
+ * the place of its argument. tag is handed back with the result */
+struct hcan_cmd{
+    uint64_t tag;
+    uint32_t ioctl;
+    uint32_t priority;         /* HCAN_PRIO_* */
+    union{
+	uint32_t val;
+	struct can_filter filter;
+    }arg;
+};
+
+/* Result of an asynchronous command. status is 0 or a negative errno value,
+ * as an ioctl call would have returned */
+struct hcan_cmd_result{
+    uint64_t tag;
+    uint32_t ioctl;
+    int32_t status;
+    struct err_stat err_stat;  /* IOC_GET_ERR_STAT */
+};
+#endif
+
 
  
 #endif
@@ -0,0 +1,104 @@
+/*EM_LICENSE*/
+/*
+ * $Id$
+ *
+ * pmdloop.c: Busy poll the message queues of a CAN node through hcan_pmd
+ * (see hcan_pmd.h). Received messages are counted and, with -e, sent back
+ * with the identifier incremented by one. At the end the number of messages
+ * and the time of the longest pass through the poll loop are printed; the
+ * latter is what a message may have to wait on the host side before it is
+ * seen.
+ *
+ * The CAN node has to be started first (e.g. with hcantool -m start) and
+ * the program has to be run as root. Pin it to an otherwise idle CPU, e.g.
+ * with taskset.
+ */
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <err.h>
+
+#include "hcan_pmd.h"
+
+/* Number of messages taken from the queue at once */
+#define POLL_BATCH 32
+
+int verbose=0;
+
+double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    struct can_msg msgs[POLL_BATCH];
+    struct hcan_pmd pmd;
+    unsigned long received=0,sent=0,passes=0;
+    double seconds=10,end,t,last,max_pass=0;
+    int opt,echo=0,n,i;
+
+    while((opt=getopt(argc,argv,"hevt:"))!=-1){
+	switch(opt){
+	case 'e':
+	    echo=1;
+	    break;
+	case 'v':
+	    verbose++;
+	    break;
+	case 't':
+	    seconds=atof(optarg);
+	    break;
+	default:
+	    fprintf(stderr,
+		    "usage: %s [-e] [-v] [-t seconds] /dev/canX\n"
+		    "-e         : send every received message back with id+1\n"
+		    "-v         : print the received messages\n"
+		    "-t seconds : how long to poll (default 10)\n",argv[0]);
+	    exit(1);
+	}
+    }
+
+    if(optind>=argc){
+	errx(1,"no CAN device given");
+    }
+
+    if(hcan_pmd_open(&pmd,argv[optind])){
+	err(1,"%s",argv[optind]);
+    }
+
+    last=now();
+    end=last+seconds;
+    while(last<end){
+	n=hcan_pmd_recv(&pmd,msgs,POLL_BATCH);
+	for(i=0;i<n;i++){
+	    if(verbose){
+		printf("%08x %d ts=%u\n",msgs[i].id,MSG_DLC(&msgs[i]),msgs[i].ts);
+	    }
+	    msgs[i].id++;
+	}
+	received+=n;
+
+	/* Whatever doesn't fit into the Tx queue is dropped */
+	if(echo && n){
+	    sent+=hcan_pmd_send(&pmd,msgs,n);
+	}
+
+	t=now();
+	if(t-last>max_pass) max_pass=t-last;
+	last=t;
+	passes++;
+    }
+
+    hcan_pmd_close(&pmd);
+
+    printf("received %lu, sent %lu messages in %.1f s\n",received,sent,seconds);
+    printf("%lu poll passes, longest %.1f us\n",passes,max_pass*1e6);
+
+    return 0;
+}
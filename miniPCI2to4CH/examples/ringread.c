@@ -0,0 +1,299 @@
+/*EM_LICENSE*/
+/*
+ * $Id$
+ *
+ * ringread.c: Receive CAN messages through the mmap()ed receive ring of the
+ * Linux driver and print the throughput. With -r the same is done with
+ * read() calls, so the two can be compared on the same traffic. -b sets how
+ * many messages one read() asks for; -b 1 reads them one at a time as the
+ * driver used to, so the messages per read() and the CPU time per message
+ * of the two can be compared. read() works without the receive FIFO too.
+ *
+ * The CPU time and the system calls per message are printed for both:
+ *
+ *   ringread /dev/can0        (mmap ring, poll() only to sleep)
+ *   ringread -r /dev/can0     (read())
+ *
+ * With -i the interrupts of the board during the run and the average time
+ * the driver spent in its interrupt handler are printed as well, taken from
+ * the proc file of the board.
+ *
+ * The driver has to be loaded with rx_fifo_size > 0 for the ring to exist,
+ * and the CAN node has to be started (e.g. with hcantool -m start).
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <poll.h>
+
+#include "hico_api.h"
+
+/* Number of messages asked for with one read() at most, and by default */
+#define READ_BATCH 256
+
+int verbose=0;
+int read_batch=READ_BATCH;
+unsigned long read_calls=0,poll_calls=0;
+
+double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+double cpu_time(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+
+	ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+}
+
+void print_msg(struct can_msg *msg)
+{
+    int i;
+
+    printf("%08x %d %d %d ts=%u",msg->id,MSG_FF(msg),MSG_RTR(msg),
+	    MSG_DLC(msg),msg->ts);
+    for(i=0;i<MSG_DLC(msg) && i<8;i++){
+	printf(" %02x",msg->data[i]);
+    }
+    printf("\n");
+}
+
+/* Interrupt statistics of the board, from its proc file */
+struct irq_stat{
+    unsigned long handled;
+    unsigned long rejected;
+    unsigned long long avg_ns;
+};
+
+void irq_stat_read(int fd, struct irq_stat *st)
+{
+    char pci_name[HCAN_PCI_NAME_LEN],path[128],line[256];
+    unsigned int dom,bus,dev,fn;
+    int found=0;
+    FILE *f;
+
+    if(ioctl(fd,IOC_GET_PCI_NAME,pci_name)){
+	err(1,"IOC_GET_PCI_NAME");
+    }
+
+    /* The driver names the file the same way */
+    if(sscanf(pci_name,"%x:%x:%x.%x",&dom,&bus,&dev,&fn)==4){
+	snprintf(path,sizeof(path),"/proc/hcanpci/board_%02x_%02x",bus,dev);
+    } else {
+	snprintf(path,sizeof(path),"/proc/hcanpci/board_%s",pci_name);
+    }
+
+    f=fopen(path,"r");
+    if(!f){
+	err(1,"%s",path);
+    }
+    while(fgets(line,sizeof(line),f)){
+	if(sscanf(line,"interrupts: %lu handled, %lu not ours, handler time avg %llu ns",
+		    &st->handled,&st->rejected,&st->avg_ns)==3){
+	    found=1;
+	}
+    }
+    fclose(f);
+
+    if(!found){
+	errx(1,"%s: no interrupt statistics",path);
+    }
+}
+
+/* Take messages from the mapped ring until the time is up. Returns the
+ * number of messages received */
+unsigned long ring_receive(int fd, double seconds)
+{
+    struct rx_fifo_stat stat;
+    struct hcan_ring *ring;
+    struct pollfd pfd;
+    unsigned long count=0;
+    uint32_t head,tail;
+    double end;
+    size_t len;
+
+    if(ioctl(fd,IOC_GET_RX_FIFO_STAT,&stat)){
+	err(1,"IOC_GET_RX_FIFO_STAT (driver loaded without rx_fifo_size?)");
+    }
+
+    len=HCAN_RING_LEN(stat.size);
+    ring=mmap(NULL,len,PROT_READ|PROT_WRITE,MAP_SHARED,fd,HCAN_MMAP_RX_RING);
+    if(ring==MAP_FAILED){
+	err(1,"mmap");
+    }
+
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+
+    end=now()+seconds;
+    while(now()<end){
+	head=__atomic_load_n(&ring->head,__ATOMIC_ACQUIRE);
+	tail=ring->tail;
+
+	if(head==tail){
+	    /* Nothing there - sleep until the driver adds something */
+	    poll_calls++;
+	    if(poll(&pfd,1,100)<0 && errno!=EINTR){
+		err(1,"poll");
+	    }
+	    continue;
+	}
+
+	while(tail!=head){
+	    if(verbose) print_msg(HCAN_RING_MSG(ring,tail));
+	    tail++;
+	    count++;
+	}
+	__atomic_store_n(&ring->tail,tail,__ATOMIC_RELEASE);
+    }
+
+    printf("dropped in driver: %llu\n",(unsigned long long)ring->dropped);
+    munmap(ring,len);
+
+    return count;
+}
+
+/* Same as above, with read() */
+unsigned long read_receive(int fd, double seconds)
+{
+    struct can_msg msgs[READ_BATCH];
+    struct pollfd pfd;
+    unsigned long count=0;
+    double end;
+    ssize_t ret;
+    int i;
+
+    pfd.fd=fd;
+    pfd.events=POLLIN;
+
+    end=now()+seconds;
+    while(now()<end){
+	poll_calls++;
+	if(poll(&pfd,1,100)<0 && errno!=EINTR){
+	    err(1,"poll");
+	}
+	if(!(pfd.revents&POLLIN)) continue;
+
+	ret=read(fd,msgs,read_batch*sizeof(struct can_msg));
+	read_calls++;
+	if(ret<0){
+	    if(errno==EAGAIN || errno==EINTR) continue;
+	    err(1,"read");
+	}
+
+	for(i=0;i<ret/sizeof(struct can_msg);i++){
+	    if(verbose) print_msg(&msgs[i]);
+	    count++;
+	}
+    }
+
+    return count;
+}
+
+int main(int argc, char *argv[])
+{
+    int opt,fd,use_read=0,irq_stats=0;
+    struct irq_stat i0,i1;
+    double seconds=10,t0,c0,t,c;
+    unsigned long count;
+
+    while((opt=getopt(argc,argv,"hrvt:b:i"))!=-1){
+	switch(opt){
+	case 'r':
+	    use_read=1;
+	    break;
+	case 'b':
+	    read_batch=atoi(optarg);
+	    if(read_batch<1 || read_batch>READ_BATCH){
+		errx(1,"-b takes 1 to %d messages",READ_BATCH);
+	    }
+	    break;
+	case 'v':
+	    verbose++;
+	    break;
+	case 'i':
+	    irq_stats=1;
+	    break;
+	case 't':
+	    seconds=atof(optarg);
+	    break;
+	default:
+	    fprintf(stderr,
+		    "usage: %s [-r [-b messages]] [-i] [-v] [-t seconds] /dev/canX\n"
+		    "-r         : use read() instead of the mmap()ed ring\n"
+		    "-b messages: messages asked for with one read() (default %d)\n"
+		    "-i         : print the interrupt statistics of the board\n"
+		    "-v         : print the received messages\n"
+		    "-t seconds : how long to receive (default 10)\n",argv[0],READ_BATCH);
+	    exit(1);
+	}
+    }
+
+    if(optind>=argc){
+	errx(1,"no CAN device given");
+    }
+
+    fd=open(argv[optind],O_RDWR|O_NONBLOCK);
+    if(fd<0){
+	err(1,"%s",argv[optind]);
+    }
+
+    if(irq_stats){
+	irq_stat_read(fd,&i0);
+    }
+
+    t0=now();
+    c0=cpu_time();
+
+    if(use_read){
+	count=read_receive(fd,seconds);
+    } else {
+	count=ring_receive(fd,seconds);
+    }
+
+    t=now()-t0;
+    c=cpu_time()-c0;
+
+    printf("%s: %lu messages in %.1f s (%.0f msgs/s), cpu %.3f s",
+	    use_read?"read()":"mmap ring",count,t,count/t,c);
+    if(count){
+	printf(" (%.2f us/msg)",c*1e6/count);
+    }
+    printf("\n");
+    printf("system calls: %lu poll(), %lu read(), %.3f per message\n",
+	    poll_calls,read_calls,
+	    count ? (double)(poll_calls+read_calls)/count : 0.0);
+    if(irq_stats){
+	unsigned long handled;
+	double ns;
+
+	irq_stat_read(fd,&i1);
+	handled=i1.handled-i0.handled;
+
+	/* The file has the average since the driver was loaded */
+	ns=(double)i1.avg_ns*i1.handled-(double)i0.avg_ns*i0.handled;
+	printf("interrupts: %lu handled (%.0f/s, %.2f msgs each), %lu not ours, "
+		"handler time avg %.0f ns\n",
+		handled,handled/t,handled ? (double)count/handled : 0.0,
+		i1.rejected-i0.rejected,handled ? ns/handled : 0.0);
+    }
+    if(use_read){
+	printf("read(): %lu calls of up to %d messages, %.2f msgs/call\n",
+		read_calls,read_batch,read_calls ? (double)count/read_calls : 0.0);
+    }
+
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*EM_LICENSE*/
+/*
+ * $Id$
+ *
+ * statbench.c: Measure what a status monitor costs. The status of a CAN
+ * node is read count times with the single ioctl calls a watchdog thread
+ * like status_read() of abuse.c uses (IOC_GET_MODE, IOC_GET_BOARD_STATUS,
+ * IOC_GET_IOPIN_STATUS, IOC_GET_CAN_STATUS and IOC_GET_BITRATE), and count
+ * times with one IOC_GET_NODE_STATUS. The time and the CPU time per status
+ * read are printed for both:
+ *
+ *   statbench -n 100000 /dev/can0
+ *
+ * The node doesn't have to be started, but the numbers are more telling
+ * with traffic on the bus, since the driver competes with the interrupt
+ * handler for the DPM then.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#include "hico_api.h"
+
+double now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return tv.tv_sec+tv.tv_usec/1e6;
+}
+
+double cpu_time(void)
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF,&ru);
+    return ru.ru_utime.tv_sec+ru.ru_utime.tv_usec/1e6+
+	ru.ru_stime.tv_sec+ru.ru_stime.tv_usec/1e6;
+}
+
+/* Read the status the way status_read() of abuse.c does */
+void single_read(int fd, unsigned long count)
+{
+    unsigned long i;
+    uint32_t val;
+
+    for(i=0;i<count;i++){
+	if(ioctl(fd,IOC_GET_MODE,&val)<0){
+	    err(1,"IOC_GET_MODE");
+	}
+	if(ioctl(fd,IOC_GET_BOARD_STATUS,&val)<0){
+	    err(1,"IOC_GET_BOARD_STATUS");
+	}
+	if(ioctl(fd,IOC_GET_IOPIN_STATUS,&val)<0){
+	    err(1,"IOC_GET_IOPIN_STATUS");
+	}
+	if(ioctl(fd,IOC_GET_CAN_STATUS,&val)<0){
+	    err(1,"IOC_GET_CAN_STATUS");
+	}
+	if(ioctl(fd,IOC_GET_BITRATE,&val)<0){
+	    err(1,"IOC_GET_BITRATE");
+	}
+    }
+}
+
+void snapshot_read(int fd, unsigned long count)
+{
+    unsigned long i;
+    struct node_status st;
+
+    for(i=0;i<count;i++){
+	if(ioctl(fd,IOC_GET_NODE_STATUS,&st)<0){
+	    err(1,"IOC_GET_NODE_STATUS");
+	}
+    }
+    if(st.version!=NODE_STATUS_VERSION){
+	warnx("node status version %u, expected %u",st.version,
+		NODE_STATUS_VERSION);
+    }
+}
+
+void measure(const char *name, void (*fn)(int, unsigned long), int fd,
+	unsigned long count)
+{
+    double t0,c0,t,c;
+
+    t0=now();
+    c0=cpu_time();
+    fn(fd,count);
+    t=now()-t0;
+    c=cpu_time()-c0;
+
+    printf("%-10s: %lu reads in %.3f s, %.2f us/read, CPU %.2f us/read\n",
+	    name,count,t,t*1e6/count,c*1e6/count);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt,fd;
+    long count=100000;
+
+    while((opt=getopt(argc,argv,"hn:"))!=-1){
+	switch(opt){
+	case 'n':
+	    count=atol(optarg);
+	    if(count<1){
+		errx(1,"-n takes a positive number");
+	    }
+	    break;
+	default:
+	    fprintf(stderr,
+		    "usage: %s [-n count] /dev/canX\n"
+		    "-n count: status reads of each kind (default 100000)\n",
+		    argv[0]);
+	    exit(1);
+	}
+    }
+
+    if(optind>=argc){
+	errx(1,"no CAN device given");
+    }
+
+    fd=open(argv[optind],O_RDWR|O_NONBLOCK);
+    if(fd<0){
+	err(1,"%s",argv[optind]);
+    }
+
+    measure("5 ioctls",single_read,fd,count);
+    measure("snapshot",snapshot_read,fd,count);
+
+    close(fd);
+    return 0;
+}